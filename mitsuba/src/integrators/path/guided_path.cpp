@@ -18,9 +18,13 @@
 */
 
 #include <mitsuba/render/renderproc.h>
+#include <mitsuba/render/rectwu.h>
 #include <mitsuba/render/scene.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/ssemath.h>
+#include <mitsuba/core/mmap.h>
+#include <mitsuba/core/sfcurve.h>
 
 #include <array>
 #include <atomic>
@@ -28,11 +32,25 @@
 #include <fstream>
 #include <functional>
 #include <iomanip>
+#include <memory>
 #include <sstream>
+#include <thread>
 #include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <limits>
 #include <cmath>
 
+#if defined(__LINUX__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__LINUX__) || defined(__OSX__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 MTS_NAMESPACE_BEGIN
 
 const float EPSILON = 1e-5f;
@@ -73,6 +91,11 @@ private:
     std::ofstream f;
 };
 
+// Every .sdt file starts with this magic number ("SDTF") and the format version. Version 2 stores the
+// child links of the D-tree nodes with 32 bits; files without the header predate it and use 16 bits.
+static const uint32_t SDT_MAGIC = 0x46544453;
+static const uint32_t SDT_VERSION = 2;
+
 static void addToAtomicFloat(std::atomic<Float>& var, Float val) {
     auto current = var.load();
     while (!var.compare_exchange_weak(current, current + val));
@@ -105,7 +128,12 @@ public:
     }
 
     void append(Float gradient, Float statisticalWeight) {
-        m_state.batchGradient += gradient * statisticalWeight;
+        appendBatch(gradient * statisticalWeight, statisticalWeight);
+    }
+
+    // Appends gradients that were already summed up elsewhere (weighted by their statistical weights).
+    void appendBatch(Float weightedGradientSum, Float statisticalWeight) {
+        m_state.batchGradient += weightedGradientSum;
         m_state.batchAccumulation += statisticalWeight;
 
         if (m_state.batchAccumulation > m_hparams.batchSize) {
@@ -119,7 +147,11 @@ public:
     void step(Float gradient) {
         ++m_state.iter;
 
-        Float actualLearningRate = m_hparams.learningRate * std::sqrt(1 - std::pow(m_hparams.beta2, m_state.iter)) / (1 - std::pow(m_hparams.beta1, m_state.iter));
+        // beta^iter for the bias correction, updated incrementally instead of calling std::pow every step.
+        m_state.beta1Power *= m_hparams.beta1;
+        m_state.beta2Power *= m_hparams.beta2;
+
+        Float actualLearningRate = m_hparams.learningRate * std::sqrt(1 - m_state.beta2Power) / (1 - m_state.beta1Power);
         m_state.firstMoment = m_hparams.beta1 * m_state.firstMoment + (1 - m_hparams.beta1) * gradient;
         m_state.secondMoment = m_hparams.beta2 * m_state.secondMoment + (1 - m_hparams.beta2) * gradient * gradient;
         m_state.variable -= actualLearningRate * m_state.firstMoment / (std::sqrt(m_state.secondMoment) + m_hparams.epsilon);
@@ -134,9 +166,15 @@ public:
         return m_state.variable;
     }
 
+    int batchSize() const {
+        return m_hparams.batchSize;
+    }
+
 private:
     struct State {
         int iter = 0;
+        Float beta1Power = 1;
+        Float beta2Power = 1;
         Float firstMoment = 0;
         Float secondMoment = 0;
         Float variable = 0;
@@ -177,9 +215,13 @@ enum class EDirectionalFilter {
     EBox,
 };
 
-class QuadTreeNode {
+// A node of the quadtree that is used while recording (building) a D-tree. The width of
+// the child links is a template parameter: 16-bit links keep nodes compact, but limit a
+// D-tree to 65535 nodes, so DTree switches to 32-bit links only for trees that outgrow them.
+template <typename TChildIndex>
+class TQuadTreeNode {
 public:
-    QuadTreeNode() {
+    TQuadTreeNode() {
         m_children = {};
         for (size_t i = 0; i < m_sum.size(); ++i) {
             m_sum[i].store(0, std::memory_order_relaxed);
@@ -194,27 +236,29 @@ public:
         return m_sum[index].load(std::memory_order_relaxed);
     }
 
-    void copyFrom(const QuadTreeNode& arg) {
+    template <typename TOtherChildIndex>
+    void copyFrom(const TQuadTreeNode<TOtherChildIndex>& arg) {
         for (int i = 0; i < 4; ++i) {
             setSum(i, arg.sum(i));
-            m_children[i] = arg.m_children[i];
+            setChild(i, arg.child(i));
         }
     }
 
-    QuadTreeNode(const QuadTreeNode& arg) {
+    TQuadTreeNode(const TQuadTreeNode& arg) {
         copyFrom(arg);
     }
 
-    QuadTreeNode& operator=(const QuadTreeNode& arg) {
+    TQuadTreeNode& operator=(const TQuadTreeNode& arg) {
         copyFrom(arg);
         return *this;
     }
 
-    void setChild(int idx, uint16_t val) {
-        m_children[idx] = val;
+    void setChild(int idx, size_t val) {
+        SAssert(val <= std::numeric_limits<TChildIndex>::max());
+        m_children[idx] = static_cast<TChildIndex>(val);
     }
 
-    uint16_t child(int idx) const {
+    size_t child(int idx) const {
         return m_children[idx];
     }
 
@@ -224,7 +268,11 @@ public:
         }
     }
 
-    int childIndex(Point2& p) const {
+    void addToSum(int index, Float val) {
+        addToAtomicFloat(m_sum[index], val);
+    }
+
+    static int childIndex(Point2& p) {
         int res = 0;
         for (int i = 0; i < Point2::dim; ++i) {
             if (p[i] < 0.5f) {
@@ -241,7 +289,7 @@ public:
     // Evaluates the directional irradiance *sum density* (i.e. sum / area) at a given location p.
     // To obtain radiance, the sum density (result of this function) must be divided
     // by the total statistical weight of the estimates that were summed up.
-    Float eval(Point2& p, const std::vector<QuadTreeNode>& nodes) const {
+    Float eval(Point2& p, const std::vector<TQuadTreeNode>& nodes) const {
         SAssert(p.x >= 0 && p.x <= 1 && p.y >= 0 && p.y <= 1);
         const int index = childIndex(p);
         if (isLeaf(index)) {
@@ -251,23 +299,7 @@ public:
         }
     }
 
-    Float pdf(Point2& p, const std::vector<QuadTreeNode>& nodes, int level, int& curr_level) const {
-        SAssert(p.x >= 0 && p.x <= 1 && p.y >= 0 && p.y <= 1);
-        const int index = childIndex(p);
-        if (!(sum(index) > 0)) {
-            return 0;
-        }
-
-        const Float factor = 4 * sum(index) / (sum(0) + sum(1) + sum(2) + sum(3));
-        if (isLeaf(index) || level == curr_level) {
-            return factor;
-        } else {
-            curr_level += 1;
-            return factor * nodes[child(index)].pdf(p, nodes, level, curr_level);
-        }
-    }
-
-    int depthAt(Point2& p, const std::vector<QuadTreeNode>& nodes) const {
+    int depthAt(Point2& p, const std::vector<TQuadTreeNode>& nodes) const {
         SAssert(p.x >= 0 && p.x <= 1 && p.y >= 0 && p.y <= 1);
         const int index = childIndex(p);
         if (isLeaf(index)) {
@@ -277,53 +309,7 @@ public:
         }
     }
 
-    Point2 sample(Sampler* sampler, const std::vector<QuadTreeNode>& nodes) const {
-        int index = 0;
-
-        Float topLeft = sum(0);
-        Float topRight = sum(1);
-        Float partial = topLeft + sum(2);
-        Float total = partial + topRight + sum(3);
-
-        // Should only happen when there are numerical instabilities.
-        if (!(total > 0.0f)) {
-            return sampler->next2D();
-        }
-
-        Float boundary = partial / total;
-        Point2 origin = Point2{0.0f, 0.0f};
-
-        Float sample = sampler->next1D();
-
-        if (sample < boundary) {
-            SAssert(partial > 0);
-            sample /= boundary;
-            boundary = topLeft / partial;
-        } else {
-            partial = total - partial;
-            SAssert(partial > 0);
-            origin.x = 0.5f;
-            sample = (sample - boundary) / (1.0f - boundary);
-            boundary = topRight / partial;
-            index |= 1 << 0;
-        }
-
-        if (sample < boundary) {
-            sample /= boundary;
-        } else {
-            origin.y = 0.5f;
-            sample = (sample - boundary) / (1.0f - boundary);
-            index |= 1 << 1;
-        }
-
-        if (isLeaf(index)) {
-            return origin + 0.5f * sampler->next2D();
-        } else {
-            return origin + 0.5f * nodes[child(index)].sample(sampler, nodes);
-        }
-    }
-
-    void record(Point2& p, Float irradiance, std::vector<QuadTreeNode>& nodes) {
+    void record(Point2& p, Float irradiance, std::vector<TQuadTreeNode>& nodes) {
         SAssert(p.x >= 0 && p.x <= 1 && p.y >= 0 && p.y <= 1);
         int index = childIndex(p);
 
@@ -334,7 +320,7 @@ public:
         }
     }
 
-    void setMinimumIrr(float irr, std::vector<QuadTreeNode>& nodes){
+    void setMinimumIrr(float irr, std::vector<TQuadTreeNode>& nodes){
         for(int i = 0; i < 4; ++i){
             if(isLeaf(i)){
                 float prev = m_sum[i].load();
@@ -346,39 +332,13 @@ public:
         }
     }
 
-    Float computeOverlappingArea(const Point2& min1, const Point2& max1, const Point2& min2, const Point2& max2) {
-        Float lengths[2];
-        for (int i = 0; i < 2; ++i) {
-            lengths[i] = std::max(std::min(max1[i], max2[i]) - std::max(min1[i], min2[i]), 0.0f);
-        }
-        return lengths[0] * lengths[1];
-    }
-
-    void record(const Point2& origin, Float size, Point2 nodeOrigin, Float nodeSize, Float value, std::vector<QuadTreeNode>& nodes) {
-        Float childSize = nodeSize / 2;
-        for (int i = 0; i < 4; ++i) {
-            Point2 childOrigin = nodeOrigin;
-            if (i & 1) { childOrigin[0] += childSize; }
-            if (i & 2) { childOrigin[1] += childSize; }
-
-            Float w = computeOverlappingArea(origin, origin + Point2(size), childOrigin, childOrigin + Point2(childSize));
-            if (w > 0.0f) {
-                if (isLeaf(i)) {
-                    addToAtomicFloat(m_sum[i], value * w);
-                } else {
-                    nodes[child(i)].record(origin, size, childOrigin, childSize, value, nodes);
-                }
-            }
-        }
-    }
-
     bool isLeaf(int index) const {
         return child(index) == 0;
     }
 
     // Ensure that each quadtree node's sum of irradiance estimates
     // equals that of all its children.
-    void build(std::vector<QuadTreeNode>& nodes) {
+    void build(std::vector<TQuadTreeNode>& nodes) {
         for (int i = 0; i < 4; ++i) {
             // During sampling, all irradiance estimates are accumulated in
             // the leaves, so the leaves are built by definition.
@@ -386,7 +346,7 @@ public:
                 continue;
             }
 
-            QuadTreeNode& c = nodes[child(i)];
+            TQuadTreeNode& c = nodes[child(i)];
 
             // Recursively build each child such that their sum becomes valid...
             c.build(nodes);
@@ -402,646 +362,1397 @@ public:
 
 private:
     std::array<std::atomic<Float>, 4> m_sum;
-    std::array<uint16_t, 4> m_children;
+    std::array<TChildIndex, 4> m_children;
 };
 
-class DTree {
+typedef TQuadTreeNode<uint16_t> QuadTreeNode;
+typedef TQuadTreeNode<uint32_t> WideQuadTreeNode;
+
+// LIFO stack that keeps its first N elements inline and only touches the heap for deeper traversals.
+template <typename T, size_t N>
+class InlineStack {
 public:
-    DTree() {
-        m_atomic.sum.store(0, std::memory_order_relaxed);
-        m_maxDepth = 0;
-        m_nodes.emplace_back();
-        m_nodes.front().setSum(0.0f);
+    InlineStack() : m_size(0) {
     }
 
-    const QuadTreeNode& node(size_t i) const {
-        return m_nodes[i];
+    bool empty() const {
+        return m_size == 0;
     }
 
-    bool validateMajorizingFactor(const DTree& other, float factor) const{
-        struct NodePair {
-            std::pair<size_t, int> nodeIndex;
-            std::pair<size_t, int> otherNodeIndex;
-            Float nodeFactor;
-            Float otherNodeFactor;
+    void push(const T& value) {
+        if (m_size < N) {
+            m_inline[m_size] = value;
+        } else {
+            m_overflow.push_back(value);
+        }
+        ++m_size;
+    }
+
+    T pop() {
+        SAssert(m_size > 0);
+        --m_size;
+        if (m_size < N) {
+            return m_inline[m_size];
+        }
+
+        T value = m_overflow.back();
+        m_overflow.pop_back();
+        return value;
+    }
+
+private:
+    std::array<T, N> m_inline;
+    size_t m_size;
+    std::vector<T> m_overflow;
+};
+
+// Read-only copy of a built quadtree that is used for sampling and pdf evaluation on the
+// per-bounce hot path. Nodes are stored in breadth-first order, such that the top levels,
+// which every query has to visit, are packed into a handful of cache lines, and each node
+// stores the plain (non-atomic) pdf of its four children instead of the raw sums, so a pdf
+// query simply returns the value found in the leaf it ends up in.
+// Descent is iterative, so no call-stack frames are created per level either.
+//
+// Optionally, an alias table over all leaves is built as well, which allows drawing a
+// sample in constant time from a single 2D sample (plus the position within the leaf)
+// instead of descending the tree with one random number per level. The table is built from
+// the very same leaf pdfs that pdf() returns, so both sampling methods remain consistent.
+class FlatQuadTree {
+public:
+    template <typename TNode>
+    void build(const std::vector<TNode>& nodes, bool buildAliasTable) {
+        m_nodes.clear();
+        m_nodes.reserve(nodes.size());
+        m_aliasTable.clear();
+
+        std::vector<Float> leafMasses;
+
+        // The breadth-first order is generated on the fly: the i-th entry of `order` is the building
+        // node that becomes the i-th flat node, along with the pdf, the extent and the depth of its region.
+        struct Pending {
+            size_t index;
+            Float pdf;
+            Point2 origin;
+            Float size;
+            int depth;
         };
 
-        std::stack<NodePair> pairStack;
-        pairStack.push({std::make_pair(0, -1), std::make_pair(0, -1), 1.f, 1.f});
+        std::vector<Pending> order;
+        order.reserve(nodes.size());
+        order.push_back(Pending{0, 1.0f, Point2(0.0f), 1.0f, 0});
 
-        while (!pairStack.empty()) {
-            NodePair nodePair = pairStack.top();
-            pairStack.pop();
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Pending pending = order[i];
+            const TNode& node = nodes[pending.index];
+            const Float total = node.sum(0) + node.sum(1) + node.sum(2) + node.sum(3);
+            const Float childSize = pending.size / 2;
 
-            const QuadTreeNode& node = m_nodes[nodePair.nodeIndex.first];
-            const QuadTreeNode& otherNode = other.m_nodes[nodePair.otherNodeIndex.first];
+            Node flatNode;
+            for (int j = 0; j < 4; ++j) {
+                flatNode.pdf[j] = total > 0 ? pending.pdf * (4 * node.sum(j) / total) : 0.0f;
 
-            Float denom = nodePair.nodeIndex.second < 0 ? node.sum(0) + node.sum(1) + node.sum(2) + node.sum(3) : 
-                node.sum(nodePair.nodeIndex.second) * 4.f;
-            Float otherDenom = nodePair.otherNodeIndex.second < 0 ? otherNode.sum(0) + otherNode.sum(1) + otherNode.sum(2) + otherNode.sum(3) : 
-                otherNode.sum(nodePair.otherNodeIndex.second) * 4.f;
+                Point2 childOrigin = pending.origin;
+                if (j & 1) { childOrigin.x += childSize; }
+                if (j & 2) { childOrigin.y += childSize; }
 
-            for (int i = 0; i < 4; ++i) {
-                int childIdx = nodePair.nodeIndex.second < 0 ? i : nodePair.nodeIndex.second;
-                int otherChildIdx = nodePair.otherNodeIndex.second < 0 ? i : nodePair.otherNodeIndex.second;
-
-                Float pdf = denom < EPSILON ? 0.f : nodePair.nodeFactor * 4.f * node.sum(childIdx) / denom;
-                Float otherPdf = otherDenom < EPSILON ? 0.f : nodePair.otherNodeFactor * 4.f * otherNode.sum(otherChildIdx) / otherDenom;
-
-                //both nodes are leaf, check if majorization factor majorizes
-                if(node.isLeaf(childIdx) && otherNode.isLeaf(otherChildIdx)){
-                    float mpdf = factor * pdf;
-                    if((mpdf - otherPdf) < -EPSILON){
-                        std::cout << "Factor " << factor << " does not majorize " << mpdf << " over " << otherPdf << std::endl;
-                        return false;
+                if (node.isLeaf(j)) {
+                    flatNode.children[j] = 0;
+                    if (buildAliasTable && flatNode.pdf[j] > 0) {
+                        m_aliasTable.push_back(AliasEntry{childOrigin, childSize, flatNode.pdf[j], pending.depth, 0.0f, 0});
+                        leafMasses.push_back(flatNode.pdf[j] * childSize * childSize);
                     }
-                }
-                else{
-                    std::pair<size_t, int> idx = node.isLeaf(childIdx) ? std::make_pair(size_t(nodePair.nodeIndex.first), childIdx) : 
-                        std::make_pair(size_t(m_nodes[nodePair.nodeIndex.first].child(childIdx)), -1);
-                    std::pair<size_t, int> otheridx = otherNode.isLeaf(otherChildIdx) ? std::make_pair(size_t(nodePair.otherNodeIndex.first), otherChildIdx) : 
-                        std::make_pair(size_t(other.m_nodes[nodePair.otherNodeIndex.first].child(otherChildIdx)), -1);
-
-                    pairStack.push({idx, otheridx, pdf, otherPdf});
+                } else {
+                    flatNode.children[j] = static_cast<uint32_t>(order.size());
+                    order.push_back(Pending{node.child(j), flatNode.pdf[j], childOrigin, childSize, pending.depth + 1});
                 }
             }
+
+            m_nodes.push_back(flatNode);
         }
 
-        return true;
+        if (buildAliasTable) {
+            buildAliases(leafMasses);
+        }
     }
 
-    void blend(const DTree& other, float treeFactor){
-        struct NodePair{
-            size_t idx;
-            std::pair<size_t, int> otherIdx;
-            float otherFactor;
-        };
-
-        std::stack<NodePair> pairStack;
-        pairStack.push({0, std::make_pair(0, -1), 1.f});
-
-        while(!pairStack.empty()){
-            NodePair nodePair = pairStack.top();
-            pairStack.pop();
+    void clear() {
+        m_nodes.clear();
+        m_nodes.shrink_to_fit();
+        m_aliasTable.clear();
+        m_aliasTable.shrink_to_fit();
+    }
 
-            QuadTreeNode& node = m_nodes[nodePair.idx];
-            const QuadTreeNode& otherNode = other.m_nodes[nodePair.otherIdx.first];
+    Float pdf(Point2 p, int level, int& curr_level) const {
+        SAssert(p.x >= 0 && p.x <= 1 && p.y >= 0 && p.y <= 1);
 
-            for (int i = 0; i < 4; ++i) {  
-                int otherChildIdx = nodePair.otherIdx.second < 0 ? i : nodePair.otherIdx.second;
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const Node& node = m_nodes[nodeIndex];
+            const int index = childIndex(p);
 
-                //only add to leaf nodes, we will call build afterwards to make sure non-leaves are updated accordingly
-                if(node.isLeaf(i)){
-                    float val = treeFactor * nodePair.otherFactor * otherNode.sum(otherChildIdx) + node.sum(i);
-                    node.setSum(i, val);
-                }
-                else{
-                    size_t childNodeIdx = node.child(i);
+            const Float pdf = node.pdf[index];
+            if (!(pdf > 0)) {
+                return 0;
+            }
 
-                    //other node is a leaf, thus we need to divide its factor by 4 to account for its energy
-                    //being separated into 4 of the current node's children
-                    if(otherNode.isLeaf(otherChildIdx)){
-                        pairStack.push({childNodeIdx, std::make_pair(nodePair.otherIdx.first, otherChildIdx), nodePair.otherFactor / 4.f});
-                    }
-                    else{
-                        pairStack.push({childNodeIdx, std::make_pair(otherNode.child(otherChildIdx), -1), nodePair.otherFactor});
-                    }
-                }
+            if (node.children[index] == 0 || level == curr_level) {
+                return pdf;
             }
+
+            curr_level += 1;
+            nodeIndex = node.children[index];
         }
     }
 
-    std::pair<Float, Float> getMajorizingFactor(const DTree& other) const{
-        struct NodePair {
-            std::pair<size_t, int> nodeIndex;
-            std::pair<size_t, int> otherNodeIndex;
-            Float nodeFactor;
-            Float otherNodeFactor;
-            int nodeLevel;
-            int otherNodeLevel;
-        };
-
-        std::pair<Float, Float> pdfPair(1.f, 1.f);
-        Float largestScalingFactor = 0.f;
+    // Also returns the pdf of the sampled point and the level of the leaf it was drawn from,
+    // i.e. exactly what pdf(result, -1, level) would compute, without a second descent.
+    Point2 sample(Sampler* sampler, Float& pdf, int& level) const {
+        if (!m_aliasTable.empty()) {
+            return sampleAliasTable(sampler, pdf, level);
+        }
 
-        std::stack<NodePair> pairStack;
-        pairStack.push({std::make_pair(0, -1), std::make_pair(0, -1), 1.f, 1.f, 0, 0});
+        Point2 origin = Point2{0.0f, 0.0f};
+        Float size = 1.0f;
+        uint32_t nodeIndex = 0;
+        level = 0;
 
-        while (!pairStack.empty()) {
-            NodePair nodePair = pairStack.top();
-            pairStack.pop();
+        while (true) {
+            const Node& node = m_nodes[nodeIndex];
+            int index = 0;
+
+            Float topLeft = node.pdf[0];
+            Float topRight = node.pdf[1];
+            Float partial = topLeft + node.pdf[2];
+            Float total = partial + topRight + node.pdf[3];
+
+            // Should only happen when there are numerical instabilities.
+            if (!(total > 0.0f)) {
+                pdf = 0;
+                return origin + size * sampler->next2D();
+            }
 
-            const QuadTreeNode& node = m_nodes[nodePair.nodeIndex.first];
-            const QuadTreeNode& otherNode = other.m_nodes[nodePair.otherNodeIndex.first];
+            Float boundary = partial / total;
+            Float sample = sampler->next1D();
 
-            Float denom = nodePair.nodeIndex.second < 0 ? node.sum(0) + node.sum(1) + node.sum(2) + node.sum(3) : 
-                node.sum(nodePair.nodeIndex.second) * 4.f;
-            Float otherDenom = nodePair.otherNodeIndex.second < 0 ? otherNode.sum(0) + otherNode.sum(1) + otherNode.sum(2) + otherNode.sum(3) : 
-                otherNode.sum(nodePair.otherNodeIndex.second) * 4.f;
+            size *= 0.5f;
 
-            for (int i = 0; i < 4; ++i) {
-                int childIdx = nodePair.nodeIndex.second < 0 ? i : nodePair.nodeIndex.second;   
-                int otherChildIdx = nodePair.otherNodeIndex.second < 0 ? i : nodePair.otherNodeIndex.second;
-
-                Float pdf = denom < EPSILON ? 0.f : nodePair.nodeFactor * 4.f * node.sum(childIdx) / denom;
-                Float otherPdf = otherDenom < EPSILON ? 0.f : nodePair.otherNodeFactor * 4.f * otherNode.sum(otherChildIdx) / otherDenom;
-
-                //both nodes are leaf, we can compute the scaling factors here
-                if(node.isLeaf(childIdx) || otherNode.isLeaf(otherChildIdx)){
-                    pdf = std::max(pdf, EPSILON);
-                    otherPdf = std::max(otherPdf, EPSILON);
-                    Float scalingFactor = otherPdf / pdf;
-
-                    //std::cout << "leaves: " << otherPdf << " " << otherDenom << " : " << pdf << " " << node.sum(childIdx) << " " << nodePair.nodeFactor << " " << denom << " : " << scalingFactor << std::endl;
-                    if(scalingFactor > largestScalingFactor){
-                        largestScalingFactor = scalingFactor;
-                        pdfPair = std::make_pair(pdf, otherPdf);
-                    }
-                }
-                else{
-                    std::pair<size_t, int> idx = node.isLeaf(childIdx) ? std::make_pair(size_t(nodePair.nodeIndex.first), childIdx) : 
-                        std::make_pair(size_t(m_nodes[nodePair.nodeIndex.first].child(childIdx)), -1);
-                    std::pair<size_t, int> otheridx = otherNode.isLeaf(otherChildIdx) ? std::make_pair(size_t(nodePair.otherNodeIndex.first), otherChildIdx) : 
-                        std::make_pair(size_t(other.m_nodes[nodePair.otherNodeIndex.first].child(otherChildIdx)), -1);
+            if (sample < boundary) {
+                SAssert(partial > 0);
+                sample /= boundary;
+                boundary = topLeft / partial;
+            } else {
+                partial = total - partial;
+                SAssert(partial > 0);
+                origin.x += size;
+                sample = (sample - boundary) / (1.0f - boundary);
+                boundary = topRight / partial;
+                index |= 1 << 0;
+            }
 
-                    int nl = nodePair.nodeLevel + 1;
-                    int onl = nodePair.otherNodeLevel + 1;
+            if (sample >= boundary) {
+                origin.y += size;
+                index |= 1 << 1;
+            }
 
-                    pairStack.push({idx, otheridx, pdf, otherPdf, nl, onl});
-                }
+            if (node.children[index] == 0) {
+                pdf = node.pdf[index];
+                return origin + size * sampler->next2D();
             }
+
+            level += 1;
+            nodeIndex = node.children[index];
         }
+    }
 
-        return pdfPair;
+    size_t approxMemoryFootprint() const {
+        return m_nodes.capacity() * sizeof(Node) + m_aliasTable.capacity() * sizeof(AliasEntry);
     }
 
-    Float mean() const {
-        if (m_atomic.statisticalWeight == 0) {
-            return 0;
+private:
+    static int childIndex(Point2& p) {
+        int res = 0;
+        for (int i = 0; i < Point2::dim; ++i) {
+            if (p[i] < 0.5f) {
+                p[i] *= 2;
+            } else {
+                p[i] = (p[i] - 0.5f) * 2;
+                res |= 1 << i;
+            }
         }
-        const Float factor = 1 / (M_PI * 4 * m_atomic.statisticalWeight);
-        return factor * m_atomic.sum;
-    }
 
-    void pinfo() const {
-        std::cout << m_atomic.statisticalWeight << " " << m_atomic.sum << std::endl;
+        return res;
     }
 
-    void recordIrradiance(Point2 p, Float irradiance, Float statisticalWeight, Float actualStatisticalWeight, EDirectionalFilter directionalFilter) {
-        if (std::isfinite(statisticalWeight) && statisticalWeight > 0) {
-            addToAtomicFloat(m_atomic.statisticalWeight, statisticalWeight);
-            addToAtomicFloat(m_atomic.realStatisticalWeight, actualStatisticalWeight);
+    // Vose's method: every entry keeps its own leaf with probability `threshold`
+    // and redirects to leaf `alias` otherwise.
+    void buildAliases(const std::vector<Float>& leafMasses) {
+        const size_t n = m_aliasTable.size();
+        if (n == 0) {
+            return;
+        }
 
-            if (std::isfinite(irradiance) && irradiance > 0) {
-                if (directionalFilter == EDirectionalFilter::ENearest) {
-                    m_nodes[0].record(p, irradiance * statisticalWeight, m_nodes);
-                } else {
-                    int depth = depthAt(p);
-                    Float size = std::pow(0.5f, depth);
+        double totalMass = 0;
+        for (Float mass : leafMasses) {
+            totalMass += mass;
+        }
 
-                    Point2 origin = p;
-                    origin.x -= size / 2;
-                    origin.y -= size / 2;
-                    m_nodes[0].record(origin, size, Point2(0.0f), 1.0f, irradiance * statisticalWeight / (size * size), m_nodes);
-                }
-            }
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = leafMasses[i] * n / totalMass;
+            (scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
         }
-    }
 
-    void setMinimumIrr(float irr){
-        m_nodes[0].setMinimumIrr(irr, m_nodes);
-    }
+        while (!small.empty() && !large.empty()) {
+            const uint32_t s = small.back();
+            small.pop_back();
+            const uint32_t l = large.back();
 
-    Float pdf(Point2 p, int level, int& curr_level) const {
-        if (!(mean() > 0)) {
-            return 1 / (4 * M_PI);
+            m_aliasTable[s].threshold = static_cast<Float>(scaled[s]);
+            m_aliasTable[s].alias = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
         }
 
-        return m_nodes[0].pdf(p, m_nodes, level, curr_level) / (4 * M_PI);
+        // Whatever is left over is only off from 1 due to rounding.
+        for (uint32_t i : large) {
+            m_aliasTable[i].threshold = 1.0f;
+            m_aliasTable[i].alias = i;
+        }
+        for (uint32_t i : small) {
+            m_aliasTable[i].threshold = 1.0f;
+            m_aliasTable[i].alias = i;
+        }
     }
 
-    int depthAt(Point2 p) const {
-        return m_nodes[0].depthAt(p, m_nodes);
-    }
+    Point2 sampleAliasTable(Sampler* sampler, Float& pdf, int& level) const {
+        const Point2 choice = sampler->next2D();
+        const size_t n = m_aliasTable.size();
+        const size_t i = std::min(static_cast<size_t>(choice.x * n), n - 1);
 
-    int depth() const {
-        return m_maxDepth;
+        const AliasEntry& entry = m_aliasTable[i];
+        const AliasEntry& leaf = choice.y < entry.threshold ? entry : m_aliasTable[entry.alias];
+        pdf = leaf.pdf;
+        level = leaf.level;
+        return leaf.origin + leaf.size * sampler->next2D();
     }
 
-    Point2 sample(Sampler* sampler) const {
-        if (!(mean() > 0)) {
-            return sampler->next2D();
-        }
-
-        Point2 res = m_nodes[0].sample(sampler, m_nodes);
+    // 32 bytes, i.e. two nodes per cache line. A child index of 0 denotes a leaf,
+    // which is unambiguous since the root is never the child of another node.
+    struct Node {
+        std::array<Float, 4> pdf;
+        std::array<uint32_t, 4> children;
+    };
 
-        res.x = math::clamp(res.x, 0.0f, 1.0f);
-        res.y = math::clamp(res.y, 0.0f, 1.0f);
+    struct AliasEntry {
+        Point2 origin;
+        Float size;
+        Float pdf;
+        int level;
+        Float threshold;
+        uint32_t alias;
+    };
 
-        return res;
-    }
+    std::vector<Node> m_nodes;
+    std::vector<AliasEntry> m_aliasTable;
+};
 
-    size_t numNodes() const {
-        return m_nodes.size();
+// The NUMA nodes of the machine and their CPUs, as listed by the kernel. Where that information
+// is not available (i.e. anywhere but on Linux), the whole machine counts as a single node.
+class NumaTopology {
+public:
+    static int nodeCount() {
+        return (int)topology().nodeCpus.size();
     }
 
-    Float statisticalWeight() const {
-        return m_atomic.statisticalWeight;
+    // Number of CPUs of the given node; 0 if it is unknown or the node only has memory.
+    static int cpuCount(int node) {
+        return (int)topology().nodeCpus[node].size();
     }
 
-    Float actualStatisticalWeight() const {
-        return m_atomic.realStatisticalWeight;
+    // The node that the calling thread was running on when it last called updateCurrentNode(). Caching
+    // this per thread keeps it off the hot path; a thread that has migrated since merely reads remote memory.
+    static int currentNode() {
+        return s_currentNode;
     }
 
-    void setStatisticalWeight(Float statisticalWeight) {
-        m_atomic.statisticalWeight = statisticalWeight;
+    static void updateCurrentNode() {
+#if defined(__LINUX__)
+        const Topology& t = topology();
+        const int cpu = sched_getcpu();
+        s_currentNode = cpu >= 0 && cpu < (int)t.cpuNodes.size() ? t.cpuNodes[cpu] : 0;
+#endif
     }
 
-    void setActualStatisticalWeight(Float statisticalWeight) {
-        m_atomic.realStatisticalWeight = statisticalWeight;
-    }
+    // Restricts the calling thread to the CPUs of the given node. Returns false if that is not possible.
+    static bool bindCurrentThread(int node) {
+#if defined(__LINUX__)
+        const Topology& t = topology();
+        if (node < 0 || node >= nodeCount() || t.cpuNodes.empty()) {
+            return false;
+        }
 
-    void reset(const DTree& previousDTree, int newMaxDepth, Float subdivisionThreshold, bool augment) {
-        m_atomic = Atomic{};
-        m_maxDepth = 0;
-        m_nodes.clear();
-        m_nodes.emplace_back();
+        const int nCpus = (int)t.cpuNodes.size();
+        cpu_set_t* cpuset = CPU_ALLOC(nCpus);
+        if (!cpuset) {
+            return false;
+        }
 
-        struct StackNode {
-            size_t nodeIndex;
-            size_t otherNodeIndex;
-            const DTree* otherDTree;
-            int depth;
-        };
+        const size_t size = CPU_ALLOC_SIZE(nCpus);
+        CPU_ZERO_S(size, cpuset);
+        for (int cpu : t.nodeCpus[node]) {
+            CPU_SET_S(cpu, size, cpuset);
+        }
 
-        std::stack<StackNode> nodeIndices;
-        nodeIndices.push({0, 0, &previousDTree, 1});
+        const bool bound = pthread_setaffinity_np(pthread_self(), size, cpuset) == 0;
+        CPU_FREE(cpuset);
+        if (bound) {
+            s_currentNode = node;
+        }
+        return bound;
+#else
+        return node == 0;
+#endif
+    }
 
-        const Float total = previousDTree.m_atomic.sum;
-        
-        // Create the topology of the new DTree to be the refined version
-        // of the previous DTree. Subdivision is recursive if enough energy is there.
-        while (!nodeIndices.empty()) {
-            StackNode sNode = nodeIndices.top();
-            nodeIndices.pop();
+private:
+    struct Topology {
+        std::vector<std::vector<int>> nodeCpus;
+        // Node of every CPU, indexed by CPU number.
+        std::vector<int> cpuNodes;
+    };
 
-            m_maxDepth = std::max(m_maxDepth, sNode.depth);
+    static const Topology& topology() {
+        static const Topology topology = detect();
+        return topology;
+    }
 
-            const QuadTreeNode& otherNode = sNode.otherDTree->m_nodes[sNode.otherNodeIndex];
+    static Topology detect() {
+        Topology result;
+#if defined(__LINUX__)
+        for (int node = 0; ; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) {
+                break;
+            }
 
-            for (int i = 0; i < 4; ++i) {
-                m_nodes[sNode.nodeIndex].setSum(i, otherNode.sum(i));
-                const Float fraction = total > std::numeric_limits<float>::min() ? (otherNode.sum(i) / total) : std::pow(0.25f, sNode.depth);
-                if(!(fraction <= (1.0f + Epsilon))){
-                    std::cout << fraction << " " << total << " " << sNode.depth << " " << otherNode.sum(i) << std::endl;
+            // Comma-separated ranges such as "0-15,32-47".
+            std::vector<int> cpus;
+            std::string range;
+            while (std::getline(file, range, ',')) {
+                int first, last;
+                const int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+                if (n < 1) {
+                    continue;
                 }
-                SAssert(fraction <= 1.0f + Epsilon);
-
-                if ((sNode.depth < newMaxDepth && fraction > subdivisionThreshold) || !otherNode.isLeaf(i)) {
-                    if (!otherNode.isLeaf(i)) {
-                        SAssert(sNode.otherDTree == &previousDTree);
-                        nodeIndices.push({m_nodes.size(), otherNode.child(i), &previousDTree, sNode.depth + 1});
-                    } else {
-                        nodeIndices.push({m_nodes.size(), m_nodes.size(), this, sNode.depth + 1});
-                    }
-
-                    m_nodes[sNode.nodeIndex].setChild(i, static_cast<uint16_t>(m_nodes.size()));
-                    m_nodes.emplace_back();
-                    m_nodes.back().setSum(otherNode.sum(i) / 4);
-
-                    if (m_nodes.size() > std::numeric_limits<uint16_t>::max()) {
-                        SLog(EWarn, "DTreeWrapper hit maximum children count.");
-                        nodeIndices = std::stack<StackNode>();
-                        break;
+                for (int cpu = first; cpu <= (n == 2 ? last : first); ++cpu) {
+                    cpus.push_back(cpu);
+                    if (cpu >= (int)result.cpuNodes.size()) {
+                        result.cpuNodes.resize(cpu + 1, 0);
                     }
+                    result.cpuNodes[cpu] = node;
                 }
             }
+            result.nodeCpus.push_back(std::move(cpus));
         }
-
-        // Uncomment once memory becomes an issue.
-        //m_nodes.shrink_to_fit();
-
-        for (auto& node : m_nodes) {
-            node.setSum(0);
+#endif
+        if (result.nodeCpus.empty()) {
+            result.nodeCpus.emplace_back();
         }
+        return result;
     }
 
-    float computeAugmentedPdf(float oldPdf, float newPdf, float A){
-        return std::max(0.f, (A * newPdf - oldPdf) / (A - 1.f));
+    static thread_local int s_currentNode;
+};
+
+thread_local int NumaTopology::s_currentNode = 0;
+
+class DTree;
+struct DTreeWrapper;
+
+// Per-thread sparse accumulator for D-tree records. Rather than having every sample hit the shared
+// atomics of a building tree, each worker sums its contributions per (D-tree, leaf) locally. The
+// buffers are folded into the trees by DTreeSplatBufferSet::flushAll() once no thread is recording anymore.
+// Likewise, the gradients for the BSDF sampling fraction are summed up per D-tree wrapper and only
+// handed to the (locked) optimizer in whole batches.
+class DTreeSplatBuffer {
+public:
+    void splat(DTree* tree, size_t nodeIndex, int child, Float value) {
+        m_sums[Leaf{tree, nodeIndex * 4 + child}] += value;
     }
 
-    float computeAugmentedPdf(float oldPdf, float newPdf){
-        return std::max(newPdf - oldPdf, 0.f);
+    void addStatisticalWeight(DTree* tree, Float statisticalWeight, Float actualStatisticalWeight) {
+        auto& weights = m_weights[tree];
+        weights.first += statisticalWeight;
+        weights.second += actualStatisticalWeight;
     }
 
-    float computeIntegral(){
-        float integral = 0.f;
+    void addGradient(DTreeWrapper* dTree, Float gradient, Float statisticalWeight);
 
-        struct StackNode {
-            Float nodeFactor;
-            size_t nodeIdx;
-        };
+    // Adds the buffered contributions to their trees and empties the buffer.
+    void flush();
 
-        std::stack<StackNode> nodeStack;
-        nodeStack.push({1.f, 0});
+private:
+    struct Leaf {
+        DTree* tree;
+        size_t index;
 
-        while (!nodeStack.empty()) {
-            StackNode curr_stacknode = nodeStack.top();
-            nodeStack.pop();
+        bool operator==(const Leaf& other) const {
+            return tree == other.tree && index == other.index;
+        }
+    };
 
-            const QuadTreeNode& curr_node = m_nodes[curr_stacknode.nodeIdx];
-            float factor = curr_stacknode.nodeFactor / 4.f;
+    struct LeafHash {
+        size_t operator()(const Leaf& leaf) const {
+            return std::hash<const void*>()(leaf.tree) ^ (std::hash<size_t>()(leaf.index) * 2654435761u);
+        }
+    };
 
-            for (int i = 0; i < 4; ++i) {
-                //both nodes are leaves, compute difference for pdf
-                if(curr_node.isLeaf(i)){
-                    integral += curr_node.sum(i) * factor;
-                }
-                //one of the nodes are not a leaf, we add to the stack the relevant pair and add a node to the current distribution
-                else{
-                    size_t childNodeIdx = curr_node.child(i);
-                    nodeStack.push({factor, childNodeIdx});
-                }
-                
+    std::unordered_map<Leaf, Float, LeafHash> m_sums;
+    std::unordered_map<DTree*, std::pair<Float, Float>> m_weights;
+    std::unordered_map<DTreeWrapper*, std::pair<Float, Float>> m_gradients;
+};
+
+// The splat buffers of the threads that record into one SD-tree. Each set only ever flushes its own
+// buffers, so several SD-trees (e.g. of different integrator instances) can record independently.
+class DTreeSplatBufferSet {
+public:
+    DTreeSplatBufferSet() : m_id(++s_lastId) {
+    }
+
+    // Returns the buffer of the calling thread, creating it on first use. Threads remember the
+    // buffer of the set they used last, so the lock is only taken when they switch sets.
+    DTreeSplatBuffer& local() {
+        static thread_local std::pair<uint64_t, DTreeSplatBuffer*> cached(0, nullptr);
+        if (cached.first != m_id) {
+            std::lock_guard<std::mutex> lg(m_mutex);
+            auto& buffer = m_buffers[std::this_thread::get_id()];
+            if (!buffer) {
+                buffer.reset(new DTreeSplatBuffer());
             }
+            cached = std::make_pair(m_id, buffer.get());
         }
-
-        return integral;
+        return *cached.second;
     }
 
-    float buildUnmajorizedAugmented(const DTree& oldDist, const DTree& newDist){
-        m_atomic = Atomic{};
-        m_nodes.clear();
-        m_nodes.emplace_back();
-
-        struct NodePair {
-            std::pair<size_t, int> newNodeIndex;
-            std::pair<size_t, int> oldNodeIndex;
-            Float newNodeFactor;
-            Float oldNodeFactor;
-            size_t nodeIdx;
-        };
+    // Flushes the buffers of all threads of this set. Must not run concurrently with recording into it.
+    void flushAll() {
+        std::lock_guard<std::mutex> lg(m_mutex);
+        std::vector<DTreeSplatBuffer*> buffers;
+        for (auto& buffer : m_buffers) {
+            buffers.push_back(buffer.second.get());
+        }
 
-        std::stack<NodePair> pairStack;
-        pairStack.push({std::make_pair(0, -1), std::make_pair(0, -1), 1.f, 1.f, 0});
+        #pragma omp parallel for
+        for (int i = 0; i < (int)buffers.size(); ++i) {
+            buffers[i]->flush();
+        }
+    }
 
-        while (!pairStack.empty()) {
-            NodePair nodePair = pairStack.top();
-            pairStack.pop();
+private:
+    // Never reused, so that the cached buffer of a thread cannot belong to a destroyed set.
+    static std::atomic<uint64_t> s_lastId;
 
-            const QuadTreeNode& oldNode = oldDist.m_nodes[nodePair.oldNodeIndex.first];
-            const QuadTreeNode& newNode = newDist.m_nodes[nodePair.newNodeIndex.first];
+    uint64_t m_id;
+    std::mutex m_mutex;
+    std::unordered_map<std::thread::id, std::unique_ptr<DTreeSplatBuffer>> m_buffers;
+};
 
-            //required because trees might not be same depth
-            Float oldDenom = nodePair.oldNodeIndex.second < 0 ? oldNode.sum(0) + oldNode.sum(1) + oldNode.sum(2) + oldNode.sum(3) :
-                oldNode.sum(nodePair.oldNodeIndex.second) * 4.f;
-            Float newDenom = nodePair.newNodeIndex.second < 0 ? newNode.sum(0) + newNode.sum(1) + newNode.sum(2) + newNode.sum(3) : 
-                newNode.sum(nodePair.newNodeIndex.second) * 4.f; 
+std::atomic<uint64_t> DTreeSplatBufferSet::s_lastId(0);
 
-            for (int i = 0; i < 4; ++i) {
-                int oldChildIdx = nodePair.oldNodeIndex.second < 0 ? i : nodePair.oldNodeIndex.second;
-                int newChildIdx = nodePair.newNodeIndex.second < 0 ? i : nodePair.newNodeIndex.second;
-                
-                Float oldPdf = oldDenom < EPSILON ? 0.f : nodePair.oldNodeFactor * 4.f * oldNode.sum(oldChildIdx) / oldDenom;
-                Float newPdf = newDenom < EPSILON ? 0.f : nodePair.newNodeFactor * 4.f * newNode.sum(newChildIdx) / newDenom;
+class DTree {
+    struct Storage;
 
-                if(newNode.isLeaf(newChildIdx) && oldNode.isLeaf(oldChildIdx)){
-                    Float pdf = computeAugmentedPdf(oldPdf, newPdf);
-                    m_nodes[nodePair.nodeIdx].setSum(i, pdf);
-                }
-                else{
-                    m_nodes[nodePair.nodeIdx].setChild(i, static_cast<uint16_t>(m_nodes.size()));
-                    m_nodes.emplace_back();
+public:
+    DTree() {
+        m_atomic.sum.store(0, std::memory_order_relaxed);
+        m_maxDepth = 0;
+        m_aliasSampling = false;
+        clearNodes();
+    }
 
-                    std::pair<size_t, int> newIdx = newNode.isLeaf(newChildIdx) ? std::make_pair(size_t(nodePair.newNodeIndex.first), newChildIdx) : 
-                        std::make_pair(size_t(newDist.m_nodes[nodePair.newNodeIndex.first].child(newChildIdx)), -1);
-                    std::pair<size_t, int> oldIdx = oldNode.isLeaf(oldChildIdx) ? std::make_pair(size_t(nodePair.oldNodeIndex.first), oldChildIdx) : 
-                        std::make_pair(size_t(oldDist.m_nodes[nodePair.oldNodeIndex.first].child(oldChildIdx)), -1);
+    // Read-only handle to a node that hides whether the tree currently uses compact or wide child links.
+    class NodeRef {
+    public:
+        NodeRef(const Storage& storage, size_t index) : m_storage(storage), m_index(index) {
+        }
 
-                    pairStack.push({newIdx, oldIdx, newPdf, oldPdf, m_nodes.size() - 1});
-                }
-                
-            }
+        Float sum(int i) const {
+            return m_storage.wide ? m_storage.wideNodes[m_index].sum(i) : m_storage.nodes[m_index].sum(i);
         }
 
-        build();
+        size_t child(int i) const {
+            return m_storage.wide ? m_storage.wideNodes[m_index].child(i) : m_storage.nodes[m_index].child(i);
+        }
 
-        m_atomic.statisticalWeight.store(newDist.m_atomic.statisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        bool isLeaf(int i) const {
+            return child(i) == 0;
+        }
 
-        float integral = computeIntegral();
+    private:
+        const Storage& m_storage;
+        size_t m_index;
+    };
 
-        return integral;
+    NodeRef node(size_t i) const {
+        return NodeRef(*m_storage, i);
     }
 
-    float buildAugmented(const DTree& oldDist, const DTree& newDist){
-        m_atomic = Atomic{};
-        m_maxDepth = 0;
+    bool isWide() const {
+        return m_storage->wide;
+    }
 
-        auto majorizing_pair = newDist.getMajorizingFactor(oldDist);
-        float A = majorizing_pair.first < EPSILON && majorizing_pair.second < EPSILON ? 1.f : majorizing_pair.second / majorizing_pair.first;
-        //A = std::min(A, 1000.f);
+    // Whether this tree and `other` currently share their nodes, i.e. neither was modified since one was copied from the other.
+    bool sharesStorageWith(const DTree& other) const {
+        return m_storage == other.m_storage;
+    }
 
-        //bool majorizes = newDist.validateMajorizingFactor(oldDist, A);
+    // Gives the tree its own copy of the nodes in case they are still shared, which has to happen
+    // before it can be recorded into.
+    void detachStorage() {
+        mutableStorage();
+    }
 
-        //new is too similar to old, no need to create augmented distribution
-        if(std::abs(A - 1) < EPSILON){
-            return 0.f;
-        }
+    // Whether build() also prepares an alias table for constant-time sampling.
+    // The setting is kept across reset() and copied along with the tree.
+    void setAliasSampling(bool aliasSampling) {
+        m_aliasSampling = aliasSampling;
+    }
 
-        struct NodePair {
-            std::pair<size_t, int> newNodeIndex;
-            std::pair<size_t, int> oldNodeIndex;
-            Float newNodeFactor;
-            Float oldNodeFactor;
-            size_t nodeIdx;
-        };
+    bool validateMajorizingFactor(const DTree& other, float factor) const{
+        bool majorizes = true;
+        zip(*this, other, std::make_pair(1.f, 1.f), [&](int, const ZipQuadrant& node, const ZipQuadrant& otherNode,
+            const std::pair<Float, Float>& parentPdfs, std::pair<Float, Float>& pdfs) {
+            Float pdf = zipPdf(parentPdfs.first, node);
+            Float otherPdf = zipPdf(parentPdfs.second, otherNode);
+
+            //both nodes are leaf, check if majorization factor majorizes
+            if(node.isLeaf && otherNode.isLeaf){
+                float mpdf = factor * pdf;
+                if((mpdf - otherPdf) < -EPSILON){
+                    std::cout << "Factor " << factor << " does not majorize " << mpdf << " over " << otherPdf << std::endl;
+                    majorizes = false;
+                    return EZipStep::EStop;
+                }
+                return EZipStep::ESkip;
+            }
 
-        std::stack<NodePair> pairStack;
-        pairStack.push({std::make_pair(0, -1), std::make_pair(0, -1), 1.f, 1.f, 0});
+            pdfs = std::make_pair(pdf, otherPdf);
+            return EZipStep::EDescend;
+        });
 
-        m_nodes.clear();
-        m_nodes.emplace_back();
-        m_nodes[0].setSum(computeAugmentedPdf(1.f, 1.f, A));
+        return majorizes;
+    }
 
-        while (!pairStack.empty()) {
-            NodePair nodePair = pairStack.top();
-            pairStack.pop();
+    void blend(const DTree& other, float treeFactor){
+        // Copy shared storage up front, such that the node handles below see our own writes.
+        mutableStorage();
+
+        zip(*this, other, 1.f, [&](int, const ZipQuadrant& node, const ZipQuadrant& otherNode, const Float& otherFactor, Float& childOtherFactor) {
+            //only add to leaf nodes, we will call build afterwards to make sure non-leaves are updated accordingly
+            if(node.isLeaf){
+                float val = treeFactor * otherFactor * otherNode.sum + node.sum;
+                setNodeSum(node.node, node.child, val);
+                return EZipStep::ESkip;
+            }
 
-            const QuadTreeNode& oldNode = oldDist.m_nodes[nodePair.oldNodeIndex.first];
-            const QuadTreeNode& newNode = newDist.m_nodes[nodePair.newNodeIndex.first];
+            //other node is a leaf, thus we need to divide its factor by 4 to account for its energy
+            //being separated into 4 of the current node's children
+            childOtherFactor = otherNode.isLeaf ? otherFactor / 4.f : otherFactor;
+            return EZipStep::EDescend;
+        });
+    }
 
-            //required because trees might not be same depth
-            Float oldDenom = nodePair.oldNodeIndex.second < 0 ? oldNode.sum(0) + oldNode.sum(1) + oldNode.sum(2) + oldNode.sum(3) :
-                oldNode.sum(nodePair.oldNodeIndex.second) * 4.f;
-            Float newDenom = nodePair.newNodeIndex.second < 0 ? newNode.sum(0) + newNode.sum(1) + newNode.sum(2) + newNode.sum(3) : 
-                newNode.sum(nodePair.newNodeIndex.second) * 4.f; 
+    std::pair<Float, Float> getMajorizingFactor(const DTree& other) const{
+        std::pair<Float, Float> pdfPair(1.f, 1.f);
+        Float largestScalingFactor = 0.f;
 
-            for (int i = 0; i < 4; ++i) {
-                int oldChildIdx = nodePair.oldNodeIndex.second < 0 ? i : nodePair.oldNodeIndex.second;
-                int newChildIdx = nodePair.newNodeIndex.second < 0 ? i : nodePair.newNodeIndex.second;
+        zip(*this, other, std::make_pair(1.f, 1.f), [&](int, const ZipQuadrant& node, const ZipQuadrant& otherNode,
+            const std::pair<Float, Float>& parentPdfs, std::pair<Float, Float>& pdfs) {
+            Float pdf = zipPdf(parentPdfs.first, node);
+            Float otherPdf = zipPdf(parentPdfs.second, otherNode);
 
-                Float oldPdf = oldDenom < EPSILON ? 0.f : nodePair.oldNodeFactor * 4.f * oldNode.sum(oldChildIdx) / oldDenom;
-                Float newPdf = newDenom < EPSILON ? 0.f : nodePair.newNodeFactor * 4.f * newNode.sum(newChildIdx) / newDenom;
+            //both nodes are leaf, we can compute the scaling factors here
+            if(node.isLeaf || otherNode.isLeaf){
+                pdf = std::max(pdf, EPSILON);
+                otherPdf = std::max(otherPdf, EPSILON);
+                Float scalingFactor = otherPdf / pdf;
 
-                //one of the nodes are not a leaf, we add to the stack the relevant pair and add a node to the current distribution
-                if(newNode.isLeaf(newChildIdx) && oldNode.isLeaf(oldChildIdx)){
-                    Float pdf = computeAugmentedPdf(oldPdf, newPdf, A);
-                    m_nodes[nodePair.nodeIdx].setSum(i, pdf);
+                if(scalingFactor > largestScalingFactor){
+                    largestScalingFactor = scalingFactor;
+                    pdfPair = std::make_pair(pdf, otherPdf);
                 }
-                else{
-                    m_nodes[nodePair.nodeIdx].setChild(i, static_cast<uint16_t>(m_nodes.size()));
-                    m_nodes.emplace_back();
-
-                    std::pair<size_t, int> newIdx = newNode.isLeaf(newChildIdx) ? std::make_pair(size_t(nodePair.newNodeIndex.first), newChildIdx) : 
-                        std::make_pair(size_t(newDist.m_nodes[nodePair.newNodeIndex.first].child(newChildIdx)), -1);
-                    std::pair<size_t, int> oldIdx = oldNode.isLeaf(oldChildIdx) ? std::make_pair(size_t(nodePair.oldNodeIndex.first), oldChildIdx) : 
-                        std::make_pair(size_t(oldDist.m_nodes[nodePair.oldNodeIndex.first].child(oldChildIdx)), -1);
-
-                    pairStack.push({newIdx, oldIdx, newPdf, oldPdf, m_nodes.size() - 1});
-                }            
+                return EZipStep::ESkip;
             }
-        }
 
-        build();
+            pdfs = std::make_pair(pdf, otherPdf);
+            return EZipStep::EDescend;
+        });
 
-        m_atomic.statisticalWeight.store(newDist.m_atomic.statisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
-        return A - 1.f;
+        return pdfPair;
     }
 
-    size_t approxMemoryFootprint() const {
-        return m_nodes.capacity() * sizeof(QuadTreeNode) + sizeof(*this);
+    Float mean() const {
+        if (m_atomic.statisticalWeight == 0) {
+            return 0;
+        }
+        const Float factor = 1 / (M_PI * 4 * m_atomic.statisticalWeight);
+        return factor * m_atomic.sum;
     }
 
-    void build() {
-        auto& root = m_nodes[0];
+    void pinfo() const {
+        std::cout << m_atomic.statisticalWeight << " " << m_atomic.sum << std::endl;
+    }
 
-        // Build the quadtree recursively, starting from its root.
-        root.build(m_nodes);
+    // Records into the given thread-local buffer if there is one, and directly into the shared atomics otherwise.
+    void recordIrradiance(Point2 p, Float irradiance, Float statisticalWeight, Float actualStatisticalWeight, EDirectionalFilter directionalFilter,
+        DTreeSplatBuffer* splatBuffer) {
+        // Recording happens concurrently and thus never copies the storage. This is fine,
+        // since building trees own their storage exclusively from reset() until build().
+        Storage& storage = *m_storage;
+        if (std::isfinite(statisticalWeight) && statisticalWeight > 0) {
+            if (splatBuffer) {
+                splatBuffer->addStatisticalWeight(this, statisticalWeight, actualStatisticalWeight);
+            } else {
+                addStatisticalWeight(statisticalWeight, actualStatisticalWeight);
+            }
 
-        // Ensure that the overall sum of irradiance estimates equals
-        // the sum of irradiance estimates found in the quadtree.
-        Float sum = 0;
-        for (int i = 0; i < 4; ++i) {
-            sum += root.sum(i);
+            if (std::isfinite(irradiance) && irradiance > 0) {
+                if (directionalFilter == EDirectionalFilter::ENearest) {
+                    if (splatBuffer) {
+                        splatNearest(p, irradiance * statisticalWeight, *splatBuffer);
+                    } else if (storage.wide) {
+                        storage.wideNodes[0].record(p, irradiance * statisticalWeight, storage.wideNodes);
+                    } else {
+                        storage.nodes[0].record(p, irradiance * statisticalWeight, storage.nodes);
+                    }
+                } else {
+                    int depth = depthAt(p);
+                    Float size = std::pow(0.5f, depth);
+
+                    Point2 origin = p;
+                    origin.x -= size / 2;
+                    origin.y -= size / 2;
+                    Float value = irradiance * statisticalWeight / (size * size);
+                    recordBox(origin, size, value, splatBuffer);
+                }
+            }
         }
-        m_atomic.sum.store(sum);
     }
 
-    float getTotalEnergy(){
-        return m_atomic.sum;
+    void addStatisticalWeight(Float statisticalWeight, Float actualStatisticalWeight) {
+        addToAtomicFloat(m_atomic.statisticalWeight, statisticalWeight);
+        addToAtomicFloat(m_atomic.realStatisticalWeight, actualStatisticalWeight);
     }
 
-private:
-    std::vector<QuadTreeNode> m_nodes;
-
-    struct Atomic {
-        Atomic() {
-            sum.store(0, std::memory_order_relaxed);
-            statisticalWeight.store(0, std::memory_order_relaxed);
-            realStatisticalWeight.store(0, std::memory_order_relaxed);
+    void addToLeaf(size_t index, int i, Float value) {
+        Storage& storage = *m_storage;
+        if (storage.wide) {
+            storage.wideNodes[index].addToSum(i, value);
+        } else {
+            storage.nodes[index].addToSum(i, value);
         }
+    }
 
-        Atomic(const Atomic& arg) {
-            *this = arg;
+    void setMinimumIrr(float irr){
+        Storage& storage = mutableStorage();
+        if (storage.wide) {
+            storage.wideNodes[0].setMinimumIrr(irr, storage.wideNodes);
+        } else {
+            storage.nodes[0].setMinimumIrr(irr, storage.nodes);
         }
+    }
 
-        Atomic& operator=(const Atomic& arg) {
-            sum.store(arg.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
-            statisticalWeight.store(arg.statisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
-            realStatisticalWeight.store(arg.realStatisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
-
-            return *this;
+    Float pdf(Point2 p, int level, int& curr_level) const {
+        if (!(mean() > 0)) {
+            return 1 / (4 * M_PI);
         }
 
-        std::atomic<Float> sum;
-        std::atomic<Float> statisticalWeight;
-        std::atomic<Float> realStatisticalWeight;
-
-    } m_atomic;
-
-    int m_maxDepth;
-};
+        return m_storage->flatTree.pdf(p, level, curr_level) / (4 * M_PI);
+    }
 
-struct DTreeRecord {
-    Vector d;
-    Float radiance, product;
-    Float woPdf, bsdfPdf, dTreePdf;
-    Float statisticalWeight;
-    bool isDelta;
-};
+    // Radiance arriving from canonical direction p, i.e. the mean radiance times the pdf of the built tree
+    // (in canonical space), together with the side length of the leaf that contains p.
+    Float radiance(const Point2& p, Float& leafSize) const {
+        const Float mean = this->mean();
+        if (!(mean > 0)) {
+            leafSize = 1;
+            return 0;
+        }
 
-struct DTreeWrapper {
-public:
-    DTreeWrapper() : current_samples(0),
-                    req_augmented_samples(0),
-                    total_samples(0),
-                    weighted_previous_samples(0),
-                    B(0.f),
-                    m_rejPdfPair(1.f, 1.f),
-                    min_nzradiance(std::numeric_limits<float>::max()){
+        int level = 0;
+        const Float pdf = m_storage->flatTree.pdf(p, -1, level);
+        leafSize = std::pow(0.5f, (Float)(level + 1));
+        return mean * pdf;
     }
 
-    DTreeWrapper(const DTreeWrapper& other) : building(other.building),
-                                            sampling(other.sampling),
-                                            previous(other.previous),
-                                            augmented(other.augmented),
-                                            savedAug(other.savedAug),
-                                            current_samples(other.current_samples),
-                                            req_augmented_samples(other.req_augmented_samples),
-                                            total_samples(other.total_samples),
-                                            weighted_previous_samples(other.weighted_previous_samples.load()),
-                                            B(other.B),
-                                            m_rejPdfPair(other.m_rejPdfPair),
-                                            bsdfSamplingFractionOptimizer(other.bsdfSamplingFractionOptimizer),
-                                            min_nzradiance(other.min_nzradiance),
-                                            m_lock(other.m_lock)
-    {
+    // Copy that only supports sample(), pdf() and the statistics, i.e. it leaves out the quadtree nodes.
+    // The read-only layout lives in memory allocated by the calling thread, which thus decides which
+    // NUMA node the copy ends up on.
+    DTree samplingReplica() const {
+        DTree result(*this);
+        result.m_storage = std::make_shared<Storage>();
+        result.m_storage->flatTree = m_storage->flatTree;
+        return result;
     }
 
-    DTreeWrapper& operator=(const DTreeWrapper& other){
-        building = other.building;
-        sampling = other.sampling;
-        previous = other.previous;
-        augmented = other.augmented;
-        savedAug = other.savedAug;
+    int depthAt(Point2 p) const {
+        const Storage& storage = *m_storage;
+        return storage.wide ? storage.wideNodes[0].depthAt(p, storage.wideNodes) : storage.nodes[0].depthAt(p, storage.nodes);
+    }
 
-        current_samples = other.current_samples;
-        req_augmented_samples = other.req_augmented_samples;
-        total_samples = other.total_samples;
-        setAtomicFloat(weighted_previous_samples, other.weighted_previous_samples.load());
-        B = other.B;
-        m_rejPdfPair = other.m_rejPdfPair;
-        bsdfSamplingFractionOptimizer = other.bsdfSamplingFractionOptimizer;
-        min_nzradiance = other.min_nzradiance;
+    int depth() const {
+        return m_maxDepth;
+    }
 
-        m_lock = other.m_lock;
+    // Also returns pdf(result, -1, level), as well as the level it would report.
+    Point2 sample(Sampler* sampler, Float& pdf, int& level) const {
+        if (!(mean() > 0)) {
+            pdf = 1 / (4 * M_PI);
+            level = 0;
+            return sampler->next2D();
+        }
 
-        return *this;
-    }   
+        Point2 res = m_storage->flatTree.sample(sampler, pdf, level);
+        pdf /= 4 * M_PI;
 
-    void record(const DTreeRecord& rec, EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, Float actualSW) {
-        if (!rec.isDelta) {
-            Float irradiance = rec.radiance / rec.woPdf;
-            if(irradiance > 0){
-                min_nzradiance = std::min(min_nzradiance, irradiance);
-            }
-            building.recordIrradiance(dirToCanonical(rec.d), irradiance, rec.statisticalWeight, actualSW, directionalFilter);
-        }
+        res.x = math::clamp(res.x, 0.0f, 1.0f);
+        res.y = math::clamp(res.y, 0.0f, 1.0f);
 
-        if (bsdfSamplingFractionLoss != EBsdfSamplingFractionLoss::ENone && rec.product > 0) {
-            optimizeBsdfSamplingFraction(rec, bsdfSamplingFractionLoss == EBsdfSamplingFractionLoss::EKL ? 1.0f : 2.0f);
-        }
+        return res;
     }
 
-    static Vector canonicalToDir(Point2 p) {
-        const Float cosTheta = 2 * p.x - 1;
-        const Float phi = 2 * M_PI * p.y;
-
-        const Float sinTheta = sqrt(1 - cosTheta * cosTheta);
-        Float sinPhi, cosPhi;
-        math::sincos(phi, &sinPhi, &cosPhi);
+    size_t numNodes() const {
+        return m_storage->wide ? m_storage->wideNodes.size() : m_storage->nodes.size();
+    }
 
-        return {sinTheta * cosPhi, sinTheta * sinPhi, cosTheta};
+    Float statisticalWeight() const {
+        return m_atomic.statisticalWeight;
+    }
+
+    Float actualStatisticalWeight() const {
+        return m_atomic.realStatisticalWeight;
+    }
+
+    void setStatisticalWeight(Float statisticalWeight) {
+        m_atomic.statisticalWeight = statisticalWeight;
+    }
+
+    void setActualStatisticalWeight(Float statisticalWeight) {
+        m_atomic.realStatisticalWeight = statisticalWeight;
+    }
+
+    // Refines the topology of the previous tree wherever a quadrant carries more than subdivisionThreshold of its
+    // energy. Subdivisions are otherwise kept as they are, unless `prune` is set, in which case quadrants
+    // that lost their energy are collapsed again.
+    void reset(const DTree& previousDTree, int newMaxDepth, Float subdivisionThreshold, bool augment, bool prune = false) {
+        m_atomic = Atomic{};
+        m_maxDepth = 0;
+        // Starts out from fresh storage, so neither trees that still share the previous
+        // nodes nor `previousDTree` (which may well be one of them) are affected.
+        clearNodes();
+
+        struct StackNode {
+            size_t nodeIndex;
+            size_t otherNodeIndex;
+            const DTree* otherDTree;
+            int depth;
+        };
+
+        std::stack<StackNode> nodeIndices;
+        nodeIndices.push({0, 0, &previousDTree, 1});
+
+        const Float total = previousDTree.m_atomic.sum;
+        
+        // Create the topology of the new DTree to be the refined version
+        // of the previous DTree. Subdivision is recursive if enough energy is there.
+        while (!nodeIndices.empty()) {
+            StackNode sNode = nodeIndices.top();
+            nodeIndices.pop();
+
+            m_maxDepth = std::max(m_maxDepth, sNode.depth);
+
+            const NodeRef otherNode = sNode.otherDTree->node(sNode.otherNodeIndex);
+
+            for (int i = 0; i < 4; ++i) {
+                setNodeSum(sNode.nodeIndex, i, otherNode.sum(i));
+                const Float fraction = total > std::numeric_limits<float>::min() ? (otherNode.sum(i) / total) : std::pow(0.25f, sNode.depth);
+                if(!(fraction <= (1.0f + Epsilon))){
+                    std::cout << fraction << " " << total << " " << sNode.depth << " " << otherNode.sum(i) << std::endl;
+                }
+                SAssert(fraction <= 1.0f + Epsilon);
+
+                const bool refine = sNode.depth < newMaxDepth && fraction > subdivisionThreshold;
+                if (refine || (!otherNode.isLeaf(i) && !prune)) {
+                    if (numNodes() > std::numeric_limits<uint32_t>::max()) {
+                        SLog(EWarn, "DTreeWrapper hit maximum children count.");
+                        nodeIndices = std::stack<StackNode>();
+                        break;
+                    }
+
+                    size_t childIndex = appendNode();
+                    if (!otherNode.isLeaf(i)) {
+                        SAssert(sNode.otherDTree == &previousDTree);
+                        nodeIndices.push({childIndex, otherNode.child(i), &previousDTree, sNode.depth + 1});
+                    } else {
+                        nodeIndices.push({childIndex, childIndex, this, sNode.depth + 1});
+                    }
+
+                    setNodeChild(sNode.nodeIndex, i, childIndex);
+                    setNodeSum(childIndex, otherNode.sum(i) / 4);
+                }
+            }
+        }
+
+        Storage& storage = mutableStorage();
+
+        // Uncomment once memory becomes an issue.
+        //storage.nodes.shrink_to_fit();
+
+        for (auto& node : storage.nodes) {
+            node.setSum(0);
+        }
+        for (auto& node : storage.wideNodes) {
+            node.setSum(0);
+        }
+    }
+
+    float computeAugmentedPdf(float oldPdf, float newPdf, float A){
+        return std::max(0.f, (A * newPdf - oldPdf) / (A - 1.f));
+    }
+
+    float computeAugmentedPdf(float oldPdf, float newPdf){
+        return std::max(newPdf - oldPdf, 0.f);
+    }
+
+    float computeIntegral(){
+        float integral = 0.f;
+
+        struct StackNode {
+            Float nodeFactor;
+            size_t nodeIdx;
+        };
+
+        InlineStack<StackNode, 64> nodeStack;
+        nodeStack.push({1.f, 0});
+
+        while (!nodeStack.empty()) {
+            StackNode curr_stacknode = nodeStack.pop();
+
+            const NodeRef curr_node = this->node(curr_stacknode.nodeIdx);
+            float factor = curr_stacknode.nodeFactor / 4.f;
+
+            for (int i = 0; i < 4; ++i) {
+                //both nodes are leaves, compute difference for pdf
+                if(curr_node.isLeaf(i)){
+                    integral += curr_node.sum(i) * factor;
+                }
+                //one of the nodes are not a leaf, we add to the stack the relevant pair and add a node to the current distribution
+                else{
+                    size_t childNodeIdx = curr_node.child(i);
+                    nodeStack.push({factor, childNodeIdx});
+                }
+                
+            }
+        }
+
+        return integral;
+    }
+
+    float buildUnmajorizedAugmented(const DTree& oldDist, const DTree& newDist){
+        m_atomic = Atomic{};
+        clearNodes();
+
+        zip(newDist, oldDist, AugmentedState{1.f, 1.f, 0}, [&](int quadrant, const ZipQuadrant& newNode, const ZipQuadrant& oldNode,
+            const AugmentedState& parent, AugmentedState& child) {
+            Float newPdf = zipPdf(parent.newPdf, newNode);
+            Float oldPdf = zipPdf(parent.oldPdf, oldNode);
+
+            if(newNode.isLeaf && oldNode.isLeaf){
+                Float pdf = computeAugmentedPdf(oldPdf, newPdf);
+                setNodeSum(parent.nodeIdx, quadrant, pdf);
+                return EZipStep::ESkip;
+            }
+
+            size_t childNodeIdx = appendNode();
+            setNodeChild(parent.nodeIdx, quadrant, childNodeIdx);
+
+            child = AugmentedState{newPdf, oldPdf, childNodeIdx};
+            return EZipStep::EDescend;
+        });
+
+        build();
+
+        m_atomic.statisticalWeight.store(newDist.m_atomic.statisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        float integral = computeIntegral();
+
+        return integral;
+    }
+
+    float buildAugmented(const DTree& oldDist, const DTree& newDist){
+        m_atomic = Atomic{};
+        m_maxDepth = 0;
+
+        auto majorizing_pair = newDist.getMajorizingFactor(oldDist);
+        float A = majorizing_pair.first < EPSILON && majorizing_pair.second < EPSILON ? 1.f : majorizing_pair.second / majorizing_pair.first;
+        //A = std::min(A, 1000.f);
+
+        //bool majorizes = newDist.validateMajorizingFactor(oldDist, A);
+
+        //new is too similar to old, no need to create augmented distribution
+        if(std::abs(A - 1) < EPSILON){
+            return 0.f;
+        }
+
+        clearNodes();
+        setNodeSum(0, computeAugmentedPdf(1.f, 1.f, A));
+
+        zip(newDist, oldDist, AugmentedState{1.f, 1.f, 0}, [&](int quadrant, const ZipQuadrant& newNode, const ZipQuadrant& oldNode,
+            const AugmentedState& parent, AugmentedState& child) {
+            Float newPdf = zipPdf(parent.newPdf, newNode);
+            Float oldPdf = zipPdf(parent.oldPdf, oldNode);
+
+            if(newNode.isLeaf && oldNode.isLeaf){
+                Float pdf = computeAugmentedPdf(oldPdf, newPdf, A);
+                setNodeSum(parent.nodeIdx, quadrant, pdf);
+                return EZipStep::ESkip;
+            }
+
+            //one of the nodes are not a leaf, we add a node to the current distribution and descend further
+            size_t childNodeIdx = appendNode();
+            setNodeChild(parent.nodeIdx, quadrant, childNodeIdx);
+
+            child = AugmentedState{newPdf, oldPdf, childNodeIdx};
+            return EZipStep::EDescend;
+        });
+
+        build();
+
+        m_atomic.statisticalWeight.store(newDist.m_atomic.statisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return A - 1.f;
+    }
+
+    // Storage that is already contained in `countedStorage` is not counted again.
+    size_t approxMemoryFootprint(std::unordered_set<const void*>& countedStorage) const {
+        size_t result = sizeof(*this);
+        if (countedStorage.insert(m_storage.get()).second) {
+            result += sizeof(Storage) + m_storage->nodes.capacity() * sizeof(QuadTreeNode) +
+                m_storage->wideNodes.capacity() * sizeof(WideQuadTreeNode) + m_storage->flatTree.approxMemoryFootprint();
+        }
+        return result;
+    }
+
+    void build() {
+        Storage& storage = mutableStorage();
+
+        // Build the quadtree recursively, starting from its root.
+        if (storage.wide) {
+            storage.wideNodes[0].build(storage.wideNodes);
+        } else {
+            storage.nodes[0].build(storage.nodes);
+        }
+
+        // Ensure that the overall sum of irradiance estimates equals
+        // the sum of irradiance estimates found in the quadtree.
+        const NodeRef root = node(0);
+        Float sum = 0;
+        for (int i = 0; i < 4; ++i) {
+            sum += root.sum(i);
+        }
+        m_atomic.sum.store(sum);
+
+        // The topology and sums are final from here on; bake them into
+        // the read-only layout that sample() and pdf() operate on.
+        if (storage.wide) {
+            storage.flatTree.build(storage.wideNodes, m_aliasSampling);
+        } else {
+            storage.flatTree.build(storage.nodes, m_aliasSampling);
+        }
+    }
+
+    float getTotalEnergy(){
+        return m_atomic.sum;
+    }
+
+private:
+    // Switches to fresh storage holding a single compact root node with zero sums.
+    void clearNodes() {
+        m_storage = std::make_shared<Storage>();
+        m_storage->nodes.emplace_back();
+        m_storage->nodes.front().setSum(0.0f);
+    }
+
+    // Returns storage owned by this tree alone, copying the shared one first if necessary.
+    Storage& mutableStorage() {
+        if (m_storage.use_count() > 1) {
+            m_storage = std::make_shared<Storage>(*m_storage);
+        }
+        return *m_storage;
+    }
+
+    // Appends a node with zero sums and returns its index. Trees start out with compact 16-bit
+    // child links and are converted to 32-bit links once a node index no longer fits.
+    size_t appendNode() {
+        Storage& storage = mutableStorage();
+        if (!storage.wide && storage.nodes.size() > std::numeric_limits<uint16_t>::max()) {
+            storage.wideNodes.resize(storage.nodes.size());
+            for (size_t i = 0; i < storage.nodes.size(); ++i) {
+                storage.wideNodes[i].copyFrom(storage.nodes[i]);
+            }
+
+            storage.nodes.clear();
+            storage.nodes.shrink_to_fit();
+            storage.wide = true;
+        }
+
+        if (storage.wide) {
+            storage.wideNodes.emplace_back();
+            return storage.wideNodes.size() - 1;
+        } else {
+            storage.nodes.emplace_back();
+            return storage.nodes.size() - 1;
+        }
+    }
+
+    void setNodeSum(size_t index, int i, Float val) {
+        Storage& storage = mutableStorage();
+        if (storage.wide) {
+            storage.wideNodes[index].setSum(i, val);
+        } else {
+            storage.nodes[index].setSum(i, val);
+        }
+    }
+
+    void setNodeSum(size_t index, Float val) {
+        Storage& storage = mutableStorage();
+        if (storage.wide) {
+            storage.wideNodes[index].setSum(val);
+        } else {
+            storage.nodes[index].setSum(val);
+        }
+    }
+
+    enum class EZipStep {
+        ESkip,
+        EDescend,
+        EStop,
+    };
+
+    // One quadrant of one of the two trees visited by zip(). Once a tree bottoms out in a leaf
+    // while the other one continues, the leaf stands in for all of the other tree's quadrants
+    // below it: `sum` stays the leaf's sum and `nodeSum` becomes 4 * sum, as if it were split evenly.
+    struct ZipQuadrant {
+        size_t node;
+        int child;
+        Float sum;
+        Float nodeSum;
+        bool isLeaf;
+    };
+
+    // Pdf of a quadrant, given the pdf of the node (or leaf) it belongs to.
+    static Float zipPdf(Float parentPdf, const ZipQuadrant& quadrant) {
+        return quadrant.nodeSum < EPSILON ? 0.f : parentPdf * 4.f * quadrant.sum / quadrant.nodeSum;
+    }
+
+    struct AugmentedState {
+        Float newPdf;
+        Float oldPdf;
+        size_t nodeIdx;
+    };
+
+    // Walks two quadtrees of possibly different topology in lockstep, depth first. For every pair of
+    // overlapping quadrants, visitor(quadrant, a, b, parentState, childState) is invoked and decides
+    // whether to descend into the pair (filling in childState), to skip it, or to stop altogether.
+    // Descending is only valid as long as at least one of the two quadrants is not a leaf.
+    template <typename TState, typename TVisitor>
+    static void zip(const DTree& a, const DTree& b, const TState& rootState, const TVisitor& visitor) {
+        // A slot >= 0 means that the tree bottomed out in leaf `slot` of node `index`.
+        struct Cursor {
+            size_t index;
+            int slot;
+        };
+
+        struct Entry {
+            Cursor a;
+            Cursor b;
+            TState state;
+        };
+
+        InlineStack<Entry, 64> stack;
+        stack.push(Entry{Cursor{0, -1}, Cursor{0, -1}, rootState});
+
+        while (!stack.empty()) {
+            const Entry entry = stack.pop();
+
+            const NodeRef nodeA = a.node(entry.a.index);
+            const NodeRef nodeB = b.node(entry.b.index);
+
+            const Float nodeSumA = entry.a.slot < 0 ? nodeA.sum(0) + nodeA.sum(1) + nodeA.sum(2) + nodeA.sum(3) : nodeA.sum(entry.a.slot) * 4.f;
+            const Float nodeSumB = entry.b.slot < 0 ? nodeB.sum(0) + nodeB.sum(1) + nodeB.sum(2) + nodeB.sum(3) : nodeB.sum(entry.b.slot) * 4.f;
+
+            for (int i = 0; i < 4; ++i) {
+                const int childA = entry.a.slot < 0 ? i : entry.a.slot;
+                const int childB = entry.b.slot < 0 ? i : entry.b.slot;
+
+                const ZipQuadrant quadrantA{entry.a.index, childA, nodeA.sum(childA), nodeSumA, nodeA.isLeaf(childA)};
+                const ZipQuadrant quadrantB{entry.b.index, childB, nodeB.sum(childB), nodeSumB, nodeB.isLeaf(childB)};
+
+                Entry child;
+                switch (visitor(i, quadrantA, quadrantB, entry.state, child.state)) {
+                    case EZipStep::ESkip:
+                        break;
+                    case EZipStep::EDescend:
+                        SAssert(!quadrantA.isLeaf || !quadrantB.isLeaf);
+                        child.a = quadrantA.isLeaf ? Cursor{entry.a.index, childA} : Cursor{nodeA.child(childA), -1};
+                        child.b = quadrantB.isLeaf ? Cursor{entry.b.index, childB} : Cursor{nodeB.child(childB), -1};
+                        stack.push(child);
+                        break;
+                    case EZipStep::EStop:
+                        return;
+                }
+            }
+        }
+    }
+
+    void splatNearest(Point2 p, Float value, DTreeSplatBuffer& splatBuffer) {
+        SAssert(p.x >= 0 && p.x <= 1 && p.y >= 0 && p.y <= 1);
+        size_t index = 0;
+        while (true) {
+            const int i = QuadTreeNode::childIndex(p);
+            const NodeRef n = node(index);
+            if (n.isLeaf(i)) {
+                splatBuffer.splat(this, index, i, value);
+                return;
+            }
+            index = n.child(i);
+        }
+    }
+
+    // Adds value times the overlap with the square [origin, origin + size]^2 to every leaf that the square
+    // touches. The overlaps of all four children of a node are computed at once.
+    void recordBox(const Point2& origin, Float size, Float value, DTreeSplatBuffer* splatBuffer) {
+        if (m_storage->wide) {
+            recordBox(m_storage->wideNodes, origin, size, value, splatBuffer);
+        } else {
+            recordBox(m_storage->nodes, origin, size, value, splatBuffer);
+        }
+    }
+
+    template <typename TNode>
+    void recordBox(std::vector<TNode>& nodes, const Point2& origin, Float size, Float value, DTreeSplatBuffer* splatBuffer) {
+        struct Entry {
+            size_t index;
+            Point2 origin;
+            Float size;
+        };
+
+#ifdef MTS_SSE
+        const __m128 boxMinX = _mm_set1_ps(origin.x), boxMinY = _mm_set1_ps(origin.y);
+        const __m128 boxMaxX = _mm_set1_ps(origin.x + size), boxMaxY = _mm_set1_ps(origin.y + size);
+#endif
+
+        InlineStack<Entry, 64> stack;
+        stack.push(Entry{0, Point2(0.0f), 1.0f});
+        while (!stack.empty()) {
+            const Entry entry = stack.pop();
+            TNode& n = nodes[entry.index];
+
+            // Children are ordered x-major, i.e. bit 0 of the child index selects the upper half in x.
+            const Float childSize = entry.size / 2;
+#ifdef MTS_SSE
+            const __m128 childSizes = _mm_set1_ps(childSize);
+            const __m128 childMinX = _mm_add_ps(_mm_set1_ps(entry.origin.x), _mm_setr_ps(0, childSize, 0, childSize));
+            const __m128 childMinY = _mm_add_ps(_mm_set1_ps(entry.origin.y), _mm_setr_ps(0, 0, childSize, childSize));
+            const __m128 lengthX = _mm_max_ps(_mm_sub_ps(_mm_min_ps(boxMaxX, _mm_add_ps(childMinX, childSizes)), _mm_max_ps(boxMinX, childMinX)), _mm_setzero_ps());
+            const __m128 lengthY = _mm_max_ps(_mm_sub_ps(_mm_min_ps(boxMaxY, _mm_add_ps(childMinY, childSizes)), _mm_max_ps(boxMinY, childMinY)), _mm_setzero_ps());
+            const SSEVector weights(_mm_mul_ps(lengthX, lengthY));
+            const Float* w = weights.f;
+#else
+            Float w[4];
+            for (int i = 0; i < 4; ++i) {
+                const Point2 childMin(entry.origin.x + ((i & 1) ? childSize : 0), entry.origin.y + ((i & 2) ? childSize : 0));
+                const Float lengthX = std::max(std::min(origin.x + size, childMin.x + childSize) - std::max(origin.x, childMin.x), 0.0f);
+                const Float lengthY = std::max(std::min(origin.y + size, childMin.y + childSize) - std::max(origin.y, childMin.y), 0.0f);
+                w[i] = lengthX * lengthY;
+            }
+#endif
+
+            for (int i = 0; i < 4; ++i) {
+                if (!(w[i] > 0.0f)) {
+                    continue;
+                }
+
+                if (!n.isLeaf(i)) {
+                    stack.push(Entry{n.child(i), Point2(entry.origin.x + ((i & 1) ? childSize : 0), entry.origin.y + ((i & 2) ? childSize : 0)), childSize});
+                } else if (splatBuffer) {
+                    splatBuffer->splat(this, entry.index, i, value * w[i]);
+                } else {
+                    n.addToSum(i, value * w[i]);
+                }
+            }
+        }
+    }
+
+    void setNodeChild(size_t index, int i, size_t child) {
+        Storage& storage = mutableStorage();
+        if (storage.wide) {
+            storage.wideNodes[index].setChild(i, child);
+        } else {
+            storage.nodes[index].setChild(i, child);
+        }
+    }
+
+    // Topology, sums and sampling layout of the tree. Copies of a tree (e.g. the sampling tree that
+    // is assigned from the building tree) share the storage until one of them is modified.
+    struct Storage {
+        Storage() : wide(false) {
+        }
+
+        // Exactly one of the two node arrays is in use, as indicated by wide.
+        bool wide;
+        std::vector<QuadTreeNode> nodes;
+        std::vector<WideQuadTreeNode> wideNodes;
+        FlatQuadTree flatTree;
+    };
+
+    std::shared_ptr<Storage> m_storage;
+    bool m_aliasSampling;
+
+    struct Atomic {
+        Atomic() {
+            sum.store(0, std::memory_order_relaxed);
+            statisticalWeight.store(0, std::memory_order_relaxed);
+            realStatisticalWeight.store(0, std::memory_order_relaxed);
+        }
+
+        Atomic(const Atomic& arg) {
+            *this = arg;
+        }
+
+        Atomic& operator=(const Atomic& arg) {
+            sum.store(arg.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            statisticalWeight.store(arg.statisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            realStatisticalWeight.store(arg.realStatisticalWeight.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+            return *this;
+        }
+
+        std::atomic<Float> sum;
+        std::atomic<Float> statisticalWeight;
+        std::atomic<Float> realStatisticalWeight;
+
+    } m_atomic;
+
+    int m_maxDepth;
+};
+
+struct DTreeRecord {
+    Vector d;
+    Float radiance, product;
+    Float woPdf, bsdfPdf, dTreePdf;
+    Float statisticalWeight;
+    bool isDelta;
+    Point p; // Where the record was made; only used for the spatial split statistics.
+};
+
+struct DTreeWrapper {
+public:
+    DTreeWrapper() : current_samples(0),
+                    req_augmented_samples(0),
+                    total_samples(0),
+                    weighted_previous_samples(0),
+                    B(0.f),
+                    m_rejPdfPair(1.f, 1.f),
+                    min_nzradiance(std::numeric_limits<float>::max()){
+    }
+
+    DTreeWrapper(const DTreeWrapper& other) : building(other.building),
+                                            sampling(other.sampling),
+                                            previous(other.previous),
+                                            augmented(other.augmented),
+                                            savedAug(other.savedAug),
+                                            current_samples(other.current_samples),
+                                            req_augmented_samples(other.req_augmented_samples),
+                                            total_samples(other.total_samples),
+                                            weighted_previous_samples(other.weighted_previous_samples.load()),
+                                            B(other.B),
+                                            m_rejPdfPair(other.m_rejPdfPair),
+                                            bsdfSamplingFractionOptimizer(other.bsdfSamplingFractionOptimizer),
+                                            min_nzradiance(other.min_nzradiance),
+                                            m_splitStatistics(other.m_splitStatistics),
+                                            m_samplingReplicas(other.m_samplingReplicas),
+                                            m_lock(other.m_lock)
+    {
+    }
+
+    DTreeWrapper& operator=(const DTreeWrapper& other){
+        building = other.building;
+        sampling = other.sampling;
+        previous = other.previous;
+        augmented = other.augmented;
+        savedAug = other.savedAug;
+
+        current_samples = other.current_samples;
+        req_augmented_samples = other.req_augmented_samples;
+        total_samples = other.total_samples;
+        setAtomicFloat(weighted_previous_samples, other.weighted_previous_samples.load());
+        B = other.B;
+        m_rejPdfPair = other.m_rejPdfPair;
+        bsdfSamplingFractionOptimizer = other.bsdfSamplingFractionOptimizer;
+        min_nzradiance = other.min_nzradiance;
+        m_splitStatistics = other.m_splitStatistics;
+        m_samplingReplicas = other.m_samplingReplicas;
+
+        m_lock = other.m_lock;
+
+        return *this;
+    }   
+
+    void record(const DTreeRecord& rec, EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, Float actualSW,
+        DTreeSplatBuffer* splatBuffer) {
+        record(rec, dirToCanonical(rec.d), directionalFilter, bsdfSamplingFractionLoss, actualSW, splatBuffer);
+    }
+
+    // Same as above, but with the canonical coordinates of rec.d already computed by the caller.
+    void record(const DTreeRecord& rec, const Point2& canonical, EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss,
+        Float actualSW, DTreeSplatBuffer* splatBuffer) {
+        if (!rec.isDelta) {
+            Float irradiance = rec.radiance / rec.woPdf;
+            if(irradiance > 0){
+                min_nzradiance = std::min(min_nzradiance, irradiance);
+            }
+            building.recordIrradiance(canonical, irradiance, rec.statisticalWeight, actualSW, directionalFilter, splatBuffer);
+
+            const Float energy = irradiance * rec.statisticalWeight;
+            if (m_splitStatistics.histogram && std::isfinite(energy) && energy > 0) {
+                const int res = SplitStatistics::RES;
+                const int bin = std::max(std::min((int)(canonical.x * res), res - 1) * res + std::min((int)(canonical.y * res), res - 1), 0);
+                for (int axis = 0; axis < 3; ++axis) {
+                    const int half = rec.p[axis] < m_splitStatistics.center[axis] ? 0 : 1;
+                    addToAtomicFloat(m_splitStatistics.histogram[(2 * axis + half) * res * res + bin], energy);
+                }
+            }
+        }
+
+        if (bsdfSamplingFractionLoss != EBsdfSamplingFractionLoss::ENone && rec.product > 0) {
+            optimizeBsdfSamplingFraction(rec, bsdfSamplingFractionLoss == EBsdfSamplingFractionLoss::EKL ? 1.0f : 2.0f, splatBuffer);
+        }
+    }
+
+    static Vector canonicalToDir(Point2 p) {
+        const Float cosTheta = 2 * p.x - 1;
+        const Float phi = 2 * M_PI * p.y;
+
+        const Float sinTheta = sqrt(1 - cosTheta * cosTheta);
+        Float sinPhi, cosPhi;
+        math::sincos(phi, &sinPhi, &cosPhi);
+
+        return {sinTheta * cosPhi, sinTheta * sinPhi, cosTheta};
     }
 
     static Point2 dirToCanonical(const Vector& d) {
@@ -1049,584 +1760,2496 @@ public:
             return {0, 0};
         }
 
-        const Float cosTheta = std::min(std::max(d.z, -1.0f), 1.0f);
-        Float phi = std::atan2(d.y, d.x);
-        while (phi < 0)
-            phi += 2.0 * M_PI;
+        const Float cosTheta = std::min(std::max(d.z, -1.0f), 1.0f);
+        Float phi = std::atan2(d.y, d.x);
+        while (phi < 0)
+            phi += 2.0 * M_PI;
+
+        return {(cosTheta + 1) / 2, phi / (2 * M_PI)};
+    }
+
+    // Batched version of dirToCanonical(). With SSE, four directions are converted at a time and only
+    // the remainder goes through the scalar code. The vectorized atan2 agrees with std::atan2 to within
+    // a few ulp, such that directions only land in a different leaf than before if they lie right on
+    // its boundary.
+    static void dirToCanonical(const Vector* dirs, Point2* canonicals, size_t count) {
+        size_t i = 0;
+#ifdef MTS_SSE
+        for (; i + 4 <= count; i += 4) {
+            const Vector* d = dirs + i;
+            __m128 x = _mm_setr_ps(d[0].x, d[1].x, d[2].x, d[3].x);
+            __m128 y = _mm_setr_ps(d[0].y, d[1].y, d[2].y, d[3].y);
+            __m128 z = _mm_setr_ps(d[0].z, d[1].z, d[2].z, d[3].z);
+
+            // Lanes with a non-finite component map to (0, 0) like in the scalar version. They are
+            // detected from the exponent bits and zeroed up front so that no FP exception is raised.
+            const __m128i exponentMask = _mm_set1_epi32(0x7f800000);
+            const __m128i nonFinite = _mm_or_si128(_mm_or_si128(
+                _mm_cmpeq_epi32(_mm_and_si128(_mm_castps_si128(x), exponentMask), exponentMask),
+                _mm_cmpeq_epi32(_mm_and_si128(_mm_castps_si128(y), exponentMask), exponentMask)),
+                _mm_cmpeq_epi32(_mm_and_si128(_mm_castps_si128(z), exponentMask), exponentMask));
+            const __m128 finite = _mm_castsi128_ps(_mm_xor_si128(nonFinite, _mm_set1_epi32(-1)));
+            x = _mm_and_ps(x, finite);
+            y = _mm_and_ps(y, finite);
+            z = _mm_and_ps(z, finite);
+
+            const __m128 cosTheta = math::clamp_ps(z, _mm_set1_ps(-1.0f), _mm_set1_ps(1.0f));
+            const __m128 u = _mm_mul_ps(_mm_add_ps(cosTheta, _mm_set1_ps(1.0f)), _mm_set1_ps(0.5f));
+            const __m128 v = _mm_mul_ps(atan2Positive_ps(y, x), _mm_set1_ps(INV_TWOPI));
+
+            SSEVector us(_mm_and_ps(u, finite)), vs(_mm_and_ps(v, finite));
+            for (int j = 0; j < 4; ++j) {
+                canonicals[i + j] = Point2{us.f[j], vs.f[j]};
+            }
+        }
+#endif
+        for (; i < count; ++i) {
+            canonicals[i] = dirToCanonical(dirs[i]);
+        }
+    }
+
+    void computeRequiredSamples(ref<Sampler> sampler){
+        if(B < EPSILON){
+            req_augmented_samples = 0;
+        }
+        else{
+            float req = B * weighted_previous_samples.load();
+            float frac = req - int(req);
+            req_augmented_samples = req;
+            if(sampler->next1D() < frac){
+                req_augmented_samples++;
+            }
+        }
+    }
+
+    void addWeightedSampleCount(float wsc){
+        addToAtomicFloat(weighted_previous_samples, wsc);
+    }
+
+    void build(bool augment, bool augmentReweight, bool isBuilt, ref<Sampler> sampler, bool samplesSaved, bool sampleless_aug = false) {
+        previous = sampling;
+        if(sampleless_aug){
+            if(augment && isBuilt){
+                float factor = req_augmented_samples == 0 ? 
+                    0.f : std::min(double(current_samples) / req_augmented_samples, 1.0);
+
+                total_samples *= factor;
+
+                building.blend(sampling, factor);
+            }
+
+            total_samples += current_samples;
+        }
+        
+
+        /*if(min_nzradiance > 100000.f){
+            min_nzradiance = EPSILON * 2.f;
+        }*/
+
+        building.setMinimumIrr(EPSILON * 10.f);
+        building.build();
+        
+        if((augment || augmentReweight) && isBuilt){
+            if(samplesSaved){
+                savedAug = sampling;
+            }
+
+            if(augment){
+                B = augmented.buildAugmented(savedAug, building);
+
+                if(sampleless_aug){
+                    if(B < EPSILON){
+                        req_augmented_samples = 0;
+                    }
+                    else{
+                        float req = B * total_samples;
+                        float frac = req - int(req);
+                        req_augmented_samples = req;
+                        if(sampler->next1D() < frac){
+                            req_augmented_samples++;
+                        }
+                    }
+                }
+            }
+            else if(augmentReweight){
+                B = augmented.buildUnmajorizedAugmented(savedAug, building);
+            }
+        }
+
+        if(!sampleless_aug){
+            req_augmented_samples = 0;
+        }
+
+        current_samples = 0;
+        setAtomicFloat(weighted_previous_samples, 0.f);
+
+        sampling = building;
+        m_rejPdfPair = previous.getMajorizingFactor(sampling);
+
+        // They would be stale from here on.
+        m_samplingReplicas.clear();
+    }
+
+    // Makes room for one copy of the sampling tree per NUMA node. Not thread-safe.
+    void reserveSamplingReplicas(int nNodes) {
+        m_samplingReplicas.clear();
+        m_samplingReplicas.resize(nNodes);
+    }
+
+    // Copies the sampling tree into memory allocated by the calling thread, which should be bound
+    // to the given node. Different nodes may be replicated concurrently.
+    void replicateSampling(int node) {
+        m_samplingReplicas[node] = sampling.samplingReplica();
+    }
+
+    // The sampling tree that is closest to the calling thread.
+    const DTree& localSampling() const {
+        const int node = NumaTopology::currentNode();
+        return node < (int)m_samplingReplicas.size() ? m_samplingReplicas[node] : sampling;
+    }
+
+    void setAliasSampling(bool aliasSampling) {
+        building.setAliasSampling(aliasSampling);
+        sampling.setAliasSampling(aliasSampling);
+        previous.setAliasSampling(aliasSampling);
+        augmented.setAliasSampling(aliasSampling);
+        savedAug.setAliasSampling(aliasSampling);
+    }
+
+    void reset(int maxDepth, Float subdivisionThreshold, bool augment, bool prune = false) {
+        building.reset(sampling, maxDepth, subdivisionThreshold, augment, prune);
+        clearSplitStatistics();
+    }
+
+    // Enables (or disables) the statistics behind splitDivergence() for a spatial leaf with the given
+    // center in world space. They are cleared whenever the leaf changes. The histograms are only allocated
+    // while enabled, since most leaves never need them.
+    void setSplitStatistics(bool enabled, const Point& center) {
+        if (enabled != m_splitStatistics.enabled() || center != m_splitStatistics.center) {
+            m_splitStatistics.setEnabled(enabled);
+            m_splitStatistics.center = center;
+            clearSplitStatistics();
+        }
+    }
+
+    void clearSplitStatistics() {
+        m_splitStatistics.clear();
+    }
+
+    // How differently light arrived in the two halves of the spatial leaf since the last reset(), for the axis
+    // where they differ most: the larger of the total variation distance between their normalized directional
+    // distributions (on a coarse grid) and the relative difference of their energies. All axes count since the
+    // STree cycles through them, so the split along the axis that matters may only be the next but one.
+    // Lies in [0, 1]; 0 if the statistics are disabled or empty.
+    Float splitDivergence() const {
+        const int nBins = SplitStatistics::RES * SplitStatistics::RES;
+        Float result = 0;
+        if (!m_splitStatistics.histogram) {
+            return result;
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const std::atomic<Float>* halves[2] = {
+                &m_splitStatistics.histogram[2 * axis * nBins],
+                &m_splitStatistics.histogram[(2 * axis + 1) * nBins],
+            };
+
+            Float sums[2] = {0, 0};
+            for (int h = 0; h < 2; ++h) {
+                for (int i = 0; i < nBins; ++i) {
+                    sums[h] += halves[h][i].load(std::memory_order_relaxed);
+                }
+            }
+
+            if (!(sums[0] > 0) || !(sums[1] > 0)) {
+                result = std::max(result, sums[0] > 0 || sums[1] > 0 ? 1.0f : 0.0f);
+                continue;
+            }
+
+            Float distance = 0;
+            for (int i = 0; i < nBins; ++i) {
+                distance += std::abs(halves[0][i].load(std::memory_order_relaxed) / sums[0] -
+                    halves[1][i].load(std::memory_order_relaxed) / sums[1]);
+            }
+
+            result = std::max(result, std::max(distance / 2, std::abs(sums[0] - sums[1]) / (sums[0] + sums[1])));
+        }
+
+        return result;
+    }
+
+    // Guiding benefit of this D-tree's region: the flux it saw times the number of samples it saw.
+    Float energy() const {
+        return meanRadiance() * actualStatisticalWeightBuilding();
+    }
+
+    // Needed by copies made after reset() that are going to be recorded into.
+    void detachBuildingStorage() {
+        building.detachStorage();
+    }
+
+    // Also returns the pdf of the direction w.r.t. the tree it was drawn from and the level of its leaf,
+    // which match pdf(result, -1, level, augment) as long as current_samples does not change in between.
+    Vector sample(Sampler* sampler, bool augment, Float& pdf, int& level) const{
+        if(augment){
+            return current_samples >= req_augmented_samples ? canonicalToDir(localSampling().sample(sampler, pdf, level)) : canonicalToDir(augmented.sample(sampler, pdf, level));
+        }
+        else return canonicalToDir(localSampling().sample(sampler, pdf, level));
+    }
+
+    void incSampleCount(){
+        current_samples++;
+    }
+
+    double getAugmentedMultiplier(){
+        return current_samples < req_augmented_samples ? current_samples / double(req_augmented_samples) : 1;
+    }
+
+    Float pdf(const Vector& dir, int level, int& curr_level, bool sampleless_aug = false) const {
+        return pdf(dirToCanonical(dir), level, curr_level, sampleless_aug);
+    }
+
+    Float pdf(const Point2& canonical, int level, int& curr_level, bool sampleless_aug = false) const {
+        if(sampleless_aug){
+            return current_samples >= req_augmented_samples ? 
+                localSampling().pdf(canonical, level, curr_level) : 
+                augmented.pdf(canonical, level, curr_level);
+        } 
+        else{
+            return localSampling().pdf(canonical, level, curr_level);
+        }
+    }
+
+    Float diff(const DTreeWrapper& other) const {
+        return 0.0f;
+    }
+
+    int depth() const {
+        return sampling.depth();
+    }
+
+    size_t numNodes() const {
+        return sampling.numNodes();
+    }
+
+    Float meanRadiance() const {
+        return sampling.mean();
+    }
+
+    // The learned radiance arriving from the direction with the given canonical coordinates, interpolated
+    // bilinearly between the centers of the directional leaves around it. Only reads the sampling tree.
+    Float radiance(const Point2& canonical) const {
+        Float leafSize;
+        const Float center = sampling.radiance(canonical, leafSize);
+
+        // Offset towards the closest neighboring leaf center and its weight per axis. Canonical
+        // y is the azimuth, which wraps around; x is the cosine of the polar angle, which does not.
+        Float offset[2], t[2];
+        for (int a = 0; a < 2; ++a) {
+            const Float x = canonical[a] / leafSize - std::floor(canonical[a] / leafSize) - 0.5f;
+            offset[a] = x < 0 ? -leafSize : leafSize;
+            t[a] = std::min(std::abs(x), 0.5f);
+        }
+        if (!(canonical.x + offset[0] >= 0 && canonical.x + offset[0] <= 1)) {
+            t[0] = 0;
+        }
+
+        Float result = (1 - t[0]) * (1 - t[1]) * center;
+        for (int i = 1; i < 4; ++i) {
+            const Float weight = ((i & 1) ? t[0] : 1 - t[0]) * ((i & 2) ? t[1] : 1 - t[1]);
+            if (!(weight > 0)) {
+                continue;
+            }
+
+            Point2 neighbor = canonical;
+            if (i & 1) {
+                neighbor.x = std::min(std::max(neighbor.x + offset[0], 0.0f), 1.0f);
+            }
+            if (i & 2) {
+                neighbor.y += offset[1];
+                neighbor.y -= std::floor(neighbor.y);
+            }
+
+            Float neighborSize;
+            result += weight * sampling.radiance(neighbor, neighborSize);
+        }
+
+        return result;
+    }
+
+    Float statisticalWeight() const {
+        return sampling.statisticalWeight();
+    }
+
+    Float statisticalWeightBuilding() const {
+        return building.statisticalWeight();
+    }
+
+    Float actualStatisticalWeightBuilding() const {
+        return building.actualStatisticalWeight();
+    }
+
+    void setStatisticalWeightBuilding(Float statisticalWeight) {
+        building.setStatisticalWeight(statisticalWeight);
+    }
+
+    void setActualStatisticalWeightBuilding(Float statisticalWeight) {
+        building.setActualStatisticalWeight(statisticalWeight);
+    }
+
+    // D-trees whose storage is already contained in `countedStorage` only count their own size.
+    size_t approxMemoryFootprint(std::unordered_set<const void*>& countedStorage) const {
+        size_t result = building.approxMemoryFootprint(countedStorage) + sampling.approxMemoryFootprint(countedStorage) +
+            previous.approxMemoryFootprint(countedStorage) + augmented.approxMemoryFootprint(countedStorage) +
+            savedAug.approxMemoryFootprint(countedStorage);
+        for (const auto& replica : m_samplingReplicas) {
+            result += replica.approxMemoryFootprint(countedStorage);
+        }
+        if (m_splitStatistics.histogram) {
+            result += SplitStatistics::SIZE * sizeof(std::atomic<Float>);
+        }
+        return result;
+    }
+
+    inline Float bsdfSamplingFraction(Float variable) const {
+        return logistic(variable);
+    }
+
+    inline Float dBsdfSamplingFraction_dVariable(Float variable) const {
+        Float fraction = bsdfSamplingFraction(variable);
+        return fraction * (1 - fraction);
+    }
+
+    inline Float bsdfSamplingFraction() const {
+        return bsdfSamplingFraction(bsdfSamplingFractionOptimizer.variable());
+    }
+
+    // With a splat buffer, the gradient is only collected there and the lock is not taken.
+    void optimizeBsdfSamplingFraction(const DTreeRecord& rec, Float ratioPower, DTreeSplatBuffer* splatBuffer) {
+        if (splatBuffer) {
+            splatBuffer->addGradient(this, bsdfSamplingFractionGradient(rec, ratioPower), rec.statisticalWeight);
+            return;
+        }
+
+        m_lock.lock();
+
+        // ADAM GRADIENT DESCENT
+        bsdfSamplingFractionOptimizer.append(bsdfSamplingFractionGradient(rec, ratioPower), rec.statisticalWeight);
+
+        m_lock.unlock();
+    }
+
+    int bsdfSamplingFractionBatchSize() const {
+        return bsdfSamplingFractionOptimizer.batchSize();
+    }
+
+    void appendBsdfSamplingFractionGradients(Float weightedGradientSum, Float statisticalWeight) {
+        m_lock.lock();
+        bsdfSamplingFractionOptimizer.appendBatch(weightedGradientSum, statisticalWeight);
+        m_lock.unlock();
+    }
+
+    // Returns false without waiting if the optimizer is in use by another thread.
+    bool tryAppendBsdfSamplingFractionGradients(Float weightedGradientSum, Float statisticalWeight) {
+        if (!m_lock.tryLock()) {
+            return false;
+        }
+        bsdfSamplingFractionOptimizer.appendBatch(weightedGradientSum, statisticalWeight);
+        m_lock.unlock();
+        return true;
+    }
+
+    Float bsdfSamplingFractionGradient(const DTreeRecord& rec, Float ratioPower) const {
+        // GRADIENT COMPUTATION
+        Float variable = bsdfSamplingFractionOptimizer.variable();
+        Float samplingFraction = bsdfSamplingFraction(variable);
+
+        // Loss gradient w.r.t. sampling fraction
+        Float mixPdf = samplingFraction * rec.bsdfPdf + (1 - samplingFraction) * rec.dTreePdf;
+        Float ratio = std::pow(rec.product / mixPdf, ratioPower);
+        Float dLoss_dSamplingFraction = -ratio / rec.woPdf * (rec.bsdfPdf - rec.dTreePdf);
+
+        // Chain rule to get loss gradient w.r.t. trainable variable
+        Float dLoss_dVariable = dLoss_dSamplingFraction * dBsdfSamplingFraction_dVariable(variable);
+
+        // We want some regularization such that our parameter does not become too big.
+        // We use l2 regularization, resulting in the following linear gradient.
+        Float l2RegGradient = 0.01f * variable;
+
+        return l2RegGradient + dLoss_dVariable;
+    }
+
+    void dump(BlobWriter& blob, const Point& p, const Vector& size) const {
+        blob
+            << (float)p.x << (float)p.y << (float)p.z
+            << (float)size.x << (float)size.y << (float)size.z
+            << (float)sampling.mean() << (uint64_t)sampling.statisticalWeight() << (uint64_t)sampling.numNodes();
+
+        for (size_t i = 0; i < sampling.numNodes(); ++i) {
+            const auto node = sampling.node(i);
+            for (int j = 0; j < 4; ++j) {
+                blob << (float)node.sum(j) << (uint32_t)node.child(j);
+            }
+        }
+    }
+
+    std::pair<Float, Float> getMajorizingFactor(){
+        return m_rejPdfPair;
+    }
+
+private:
+#ifdef MTS_SSE
+    // atan2(y, x) mapped to [0, 2pi], using the octant reduction and polynomial of Cephes' atanf.
+    static __m128 atan2Positive_ps(__m128 y, __m128 x) {
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        const __m128 absX = _mm_and_ps(x, absMask);
+        const __m128 absY = _mm_and_ps(y, absMask);
+
+        // atan(a) for a = min / max in [0, 1]; the max guards against 0 / 0 at the poles.
+        __m128 a = _mm_div_ps(_mm_min_ps(absX, absY),
+            _mm_max_ps(_mm_max_ps(absX, absY), _mm_set1_ps(std::numeric_limits<float>::min())));
+        const __m128 reduce = _mm_cmpgt_ps(a, _mm_set1_ps(0.414213562373095f));
+        a = mux_ps(reduce, _mm_div_ps(_mm_sub_ps(a, _mm_set1_ps(1.0f)), _mm_add_ps(a, _mm_set1_ps(1.0f))), a);
+
+        const __m128 a2 = _mm_mul_ps(a, a);
+        __m128 poly = _mm_set1_ps(8.05374449538e-2f);
+        poly = _mm_add_ps(_mm_mul_ps(poly, a2), _mm_set1_ps(-1.38776856032e-1f));
+        poly = _mm_add_ps(_mm_mul_ps(poly, a2), _mm_set1_ps(1.99777106478e-1f));
+        poly = _mm_add_ps(_mm_mul_ps(poly, a2), _mm_set1_ps(-3.33329491539e-1f));
+        __m128 r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(poly, a2), a), a);
+        r = _mm_add_ps(r, _mm_and_ps(reduce, _mm_set1_ps(M_PI / 4)));
+
+        // Undo the octant folding.
+        r = mux_ps(_mm_cmpgt_ps(absY, absX), _mm_sub_ps(_mm_set1_ps(M_PI / 2), r), r);
+        const __m128 negativeX = _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(x), 31)); // includes -0 like std::atan2
+        r = mux_ps(negativeX, _mm_sub_ps(_mm_set1_ps(M_PI), r), r);
+        r = mux_ps(_mm_cmplt_ps(y, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(2 * M_PI), r), r);
+        return r;
+    }
+#endif
+
+    DTree building;
+    DTree sampling;
+    DTree previous;
+    DTree augmented;
+    DTree savedAug;
+
+    std::uint64_t current_samples;
+    std::uint64_t req_augmented_samples;
+    double total_samples;
+    std::atomic<float> weighted_previous_samples;
+    float B;
+
+    std::pair<Float, Float> m_rejPdfPair;
+
+    AdamOptimizer bsdfSamplingFractionOptimizer{0.01f};
+
+    float min_nzradiance;
+
+    struct SplitStatistics {
+        // Resolution of the directional histograms per canonical axis.
+        static const int RES = 4;
+
+        static const int SIZE = 3 * 2 * RES * RES;
+
+        SplitStatistics() : center(0.0f) {
+        }
+
+        SplitStatistics(const SplitStatistics& arg) {
+            *this = arg;
+        }
+
+        SplitStatistics& operator=(const SplitStatistics& arg) {
+            setEnabled(arg.enabled());
+            center = arg.center;
+            if (histogram) {
+                for (int i = 0; i < SIZE; ++i) {
+                    histogram[i].store(arg.histogram[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+            }
+            return *this;
+        }
+
+        bool enabled() const {
+            return (bool)histogram;
+        }
+
+        void setEnabled(bool enabled) {
+            if (!enabled) {
+                histogram.reset();
+            } else if (!histogram) {
+                histogram.reset(new std::atomic<Float>[SIZE]);
+                clear();
+            }
+        }
+
+        void clear() {
+            if (histogram) {
+                for (int i = 0; i < SIZE; ++i) {
+                    histogram[i].store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        Point center;
+        // RES * RES bins for each half of the leaf, lower before upper, for each of the three axes. Null while
+        // the statistics are disabled.
+        std::unique_ptr<std::atomic<Float>[]> histogram;
+    } m_splitStatistics;
+
+    // Copies of the sampling tree per NUMA node, for sample() and pdf(). Only made on request, see
+    // STree::replicateSamplingTrees(), and dropped by the next build().
+    std::vector<DTree> m_samplingReplicas;
+
+    class SpinLock {
+    public:
+        SpinLock() {
+            m_mutex.clear(std::memory_order_release);
+        }
+
+        SpinLock(const SpinLock& other) { m_mutex.clear(std::memory_order_release); }
+        SpinLock& operator=(const SpinLock& other) { return *this; }
+
+        void lock() {
+            while (m_mutex.test_and_set(std::memory_order_acquire)) { }
+        }
+
+        bool tryLock() {
+            return !m_mutex.test_and_set(std::memory_order_acquire);
+        }
+
+        void unlock() {
+            m_mutex.clear(std::memory_order_release);
+        }
+    private:
+        std::atomic_flag m_mutex;
+    } m_lock;
+};
+
+inline void DTreeSplatBuffer::addGradient(DTreeWrapper* dTree, Float gradient, Float statisticalWeight) {
+    auto& batch = m_gradients[dTree];
+    batch.first += gradient * statisticalWeight;
+    batch.second += statisticalWeight;
+
+    // Should another thread currently be stepping the optimizer, simply keep on collecting.
+    if (batch.second > dTree->bsdfSamplingFractionBatchSize() &&
+        dTree->tryAppendBsdfSamplingFractionGradients(batch.first, batch.second)) {
+        batch = std::make_pair(0.0f, 0.0f);
+    }
+}
+
+inline void DTreeSplatBuffer::flush() {
+    for (const auto& weights : m_weights) {
+        weights.first->addStatisticalWeight(weights.second.first, weights.second.second);
+    }
+
+    for (const auto& sum : m_sums) {
+        sum.first.tree->addToLeaf(sum.first.index / 4, (int)(sum.first.index % 4), sum.second);
+    }
+
+    for (const auto& gradients : m_gradients) {
+        if (gradients.second.second > 0) {
+            gradients.first->appendBsdfSamplingFractionGradients(gradients.second.first, gradients.second.second);
+        }
+    }
+
+    m_weights.clear();
+    m_sums.clear();
+    m_gradients.clear();
+}
+
+// Dense, index-addressed storage for the D-trees of the STree leaves. Elements live in fixed-size chunks
+// and never move, so besides growing the pool from a single thread (resize), slots can also be
+// claimed concurrently (see at) once the chunk table has been reserved for the final size.
+class DTreeWrapperPool {
+public:
+    // Values of a slot that does not reference a D-tree yet.
+    static const uint32_t UNALLOCATED = 0xffffffff;
+    static const uint32_t CLAIMING = 0xfffffffe;
+
+    DTreeWrapperPool() : m_size(0), m_numChunks(0) {
+    }
+
+    DTreeWrapperPool(const DTreeWrapperPool&) = delete;
+    DTreeWrapperPool& operator=(const DTreeWrapperPool&) = delete;
+
+    ~DTreeWrapperPool() {
+        clear();
+        for (size_t i = 0; i < m_numChunks; ++i) {
+            ::operator delete(m_chunks[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    size_t size() const {
+        return m_size.load(std::memory_order_acquire);
+    }
+
+    DTreeWrapper& operator[](size_t i) {
+        return m_chunks[i / CHUNK_SIZE].load(std::memory_order_relaxed)[i % CHUNK_SIZE];
+    }
+
+    const DTreeWrapper& operator[](size_t i) const {
+        return m_chunks[i / CHUNK_SIZE].load(std::memory_order_relaxed)[i % CHUNK_SIZE];
+    }
+
+    // Unallocated slots copy this D-tree when they are claimed. It has to undergo the same
+    // per-iteration processing as the allocated ones.
+    DTreeWrapper& prototype() {
+        return m_prototype;
+    }
+
+    void clear() {
+        const size_t size = m_size.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < size; ++i) {
+            (*this)[i].~DTreeWrapper();
+        }
+        m_size.store(0, std::memory_order_relaxed);
+        m_prototype = DTreeWrapper();
+    }
+
+    void swap(DTreeWrapperPool& other) {
+        const size_t size = m_size.load(std::memory_order_relaxed);
+        m_size.store(other.m_size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.m_size.store(size, std::memory_order_relaxed);
+        std::swap(m_chunks, other.m_chunks);
+        std::swap(m_numChunks, other.m_numChunks);
+        std::swap(m_prototype, other.m_prototype);
+    }
+
+    // Grows the chunk table such that up to capacity elements can be added without reallocating it.
+    void reserve(size_t capacity) {
+        const size_t numChunks = (capacity + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        if (numChunks <= m_numChunks) {
+            return;
+        }
+
+        std::unique_ptr<std::atomic<DTreeWrapper*>[]> chunks(new std::atomic<DTreeWrapper*>[numChunks]);
+        for (size_t i = 0; i < numChunks; ++i) {
+            chunks[i].store(i < m_numChunks ? m_chunks[i].load(std::memory_order_relaxed) : nullptr, std::memory_order_relaxed);
+        }
+        m_chunks = std::move(chunks);
+        m_numChunks = numChunks;
+    }
+
+    // Appends default-constructed D-trees; not thread-safe.
+    void resize(size_t size) {
+        SAssert(size >= this->size());
+        reserve(size);
+        for (size_t i = this->size(); i < size; ++i) {
+            new (&chunk(i / CHUNK_SIZE)[i % CHUNK_SIZE]) DTreeWrapper();
+        }
+        m_size.store(size, std::memory_order_release);
+    }
+
+    // Returns the D-tree referenced by the given slot and claims a copy of the prototype for it if
+    // it is still unallocated. Threads that race for the same slot wait for the one that won the
+    // claim, such that no orphaned D-trees are left behind in the pool. A freshly claimed D-tree is
+    // passed to init before any other thread gets to see it.
+    template <typename TInit>
+    DTreeWrapper& at(std::atomic<uint32_t>& slot, const TInit& init) {
+        uint32_t index = slot.load(std::memory_order_acquire);
+        if (index == UNALLOCATED && slot.compare_exchange_strong(index, CLAIMING, std::memory_order_acq_rel)) {
+            index = (uint32_t)m_size.fetch_add(1, std::memory_order_acq_rel);
+            SAssert(index / CHUNK_SIZE < m_numChunks);
+            DTreeWrapper* dTree = new (&chunk(index / CHUNK_SIZE)[index % CHUNK_SIZE]) DTreeWrapper(m_prototype);
+            dTree->detachBuildingStorage();
+            init(*dTree);
+            slot.store(index, std::memory_order_release);
+        }
+
+        while (index == CLAIMING) {
+            std::this_thread::yield();
+            index = slot.load(std::memory_order_acquire);
+        }
+
+        return (*this)[index];
+    }
+
+    DTreeWrapper& at(std::atomic<uint32_t>& slot) {
+        return at(slot, [](DTreeWrapper&) {});
+    }
+
+    // Read-only access, where the prototype stands in for unallocated slots (and for slots that
+    // another thread is claiming right now, whose copy is not complete yet).
+    const DTreeWrapper& at(const std::atomic<uint32_t>& slot) const {
+        const uint32_t index = slot.load(std::memory_order_acquire);
+        return index >= CLAIMING ? m_prototype : (*this)[index];
+    }
+
+private:
+    static const size_t CHUNK_SIZE = 256;
+
+    DTreeWrapper* chunk(size_t i) {
+        DTreeWrapper* result = m_chunks[i].load(std::memory_order_acquire);
+        if (!result) {
+            DTreeWrapper* newChunk = static_cast<DTreeWrapper*>(::operator new(CHUNK_SIZE * sizeof(DTreeWrapper)));
+            if (m_chunks[i].compare_exchange_strong(result, newChunk, std::memory_order_acq_rel)) {
+                result = newChunk;
+            } else {
+                ::operator delete(newChunk);
+            }
+        }
+        return result;
+    }
+
+    std::atomic<size_t> m_size;
+    std::unique_ptr<std::atomic<DTreeWrapper*>[]> m_chunks;
+    size_t m_numChunks;
+    DTreeWrapper m_prototype;
+};
+
+// Nodes only hold the spatial subdivision; the D-trees of the leaves live in a separate dense
+// array of the STree (see dTreeIndex) such that descending the tree stays within a few cache lines.
+struct STreeNode {
+    STreeNode() {
+        children = {};
+        isLeaf = true;
+        axis = 0;
+        level = 0;
+        dTreeIndex.store(0, std::memory_order_relaxed);
+    }
+
+    STreeNode(const STreeNode& other) {
+        *this = other;
+    }
+
+    STreeNode& operator=(const STreeNode& other) {
+        isLeaf = other.isLeaf;
+        axis = other.axis;
+        level = other.level;
+        dTreeIndex.store(other.dTreeIndex.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        children = other.children;
+        return *this;
+    }
+
+    int childIndex(Point& p) const {
+        if (p[axis] < 0.5f) {
+            p[axis] *= 2;
+            return 0;
+        } else {
+            p[axis] = (p[axis] - 0.5f) * 2;
+            return 1;
+        }
+    }
+
+    int nodeIndex(Point& p) const {
+        return children[childIndex(p)];
+    }
+
+    // Number of times axis a was split above this node; the root splits along x and the
+    // axes alternate from there on.
+    int splits(int a) const {
+        return (level + 2 - a) / 3;
+    }
+
+    int depth(Point& p, const std::vector<STreeNode>& nodes) const {
+        SAssert(p[axis] >= 0 && p[axis] <= 1);
+        if (isLeaf) {
+            return 1;
+        } else {
+            return 1 + nodes[nodeIndex(p)].depth(p, nodes);
+        }
+    }
+
+    int depth(const std::vector<STreeNode>& nodes) const {
+        int result = 1;
+
+        if (!isLeaf) {
+            for (auto c : children) {
+                result = std::max(result, 1 + nodes[c].depth(nodes));
+            }
+        }
+
+        return result;
+    }
+
+    void forEachLeaf(
+        std::function<void(const DTreeWrapper*, const Point&, const Vector&)> func,
+        Point p, Vector size, const std::vector<STreeNode>& nodes, const DTreeWrapperPool& dTrees) const {
+
+        if (isLeaf) {
+            func(&dTrees.at(dTreeIndex), p, size);
+        } else {
+            size[axis] /= 2;
+            for (int i = 0; i < 2; ++i) {
+                Point childP = p;
+                if (i == 1) {
+                    childP[axis] += size[axis];
+                }
+
+                nodes[children[i]].forEachLeaf(func, childP, size, nodes, dTrees);
+            }
+        }
+    }
+
+    bool isLeaf;
+    uint8_t axis;
+    uint16_t level;
+    // Index into the D-tree pool of the STree; only meaningful for leaves. May be
+    // DTreeWrapperPool::UNALLOCATED for lazily allocated leaves.
+    std::atomic<uint32_t> dTreeIndex;
+    std::array<uint32_t, 2> children;
+};
+
+
+class STree {
+public:
+    STree(const AABB& aabb) : m_generation(0), m_splitDivergenceThreshold(0), m_threadLocalSplatting(false) {
+        clear();
+
+        m_aabb = aabb;
+
+        // Enlarge AABB to turn it into a cube. This has the effect
+        // of nicer hierarchical subdivisions.
+        Vector size = m_aabb.max - m_aabb.min;
+        Float maxSize = std::max(std::max(size.x, size.y), size.z);
+        m_aabb.max = m_aabb.min + Vector(maxSize);
+    }
+
+    ~STree() {
+        // Buffered records point into our D-trees and must not outlive them.
+        flushSplatBuffers();
+    }
+
+    void clear() {
+        ++m_generation;
+        m_nodes.clear();
+        m_nodes.emplace_back();
+        m_dTrees.clear();
+        m_dTrees.resize(1);
+        m_lazyDTrees = false;
+        onTopologyChanged();
+    }
+
+    // Turns the (still undivided) tree into one whose leaves only get a D-tree once they are first
+    // looked up or recorded into, which keeps deep static subdivisions of mostly empty scenes affordable.
+    // Until then, a leaf behaves like the D-tree prototype of the pool.
+    void setLazyDTrees() {
+        SAssert(m_nodes.size() == 1);
+        m_dTrees.clear();
+        m_nodes[0].dTreeIndex.store(DTreeWrapperPool::UNALLOCATED, std::memory_order_relaxed);
+        m_lazyDTrees = true;
+    }
+
+    void setThreadLocalSplatting(bool threadLocalSplatting) {
+        m_threadLocalSplatting = threadLocalSplatting;
+    }
+
+    // The buffer that records of the calling thread should go to, or nullptr when recording atomically.
+    DTreeSplatBuffer* splatBuffer() const {
+        return m_threadLocalSplatting ? &m_splatBuffers.local() : nullptr;
+    }
+
+    // Folds all buffered records into the building D-trees. Neither the topology of the
+    // SD-tree nor the building trees may change while records are still buffered.
+    void flushSplatBuffers() {
+        if (m_threadLocalSplatting) {
+            m_splatBuffers.flushAll();
+        }
+    }
+
+    void subdivide(int levels){
+        for(int i = 0; i < levels; ++i){
+            subdivideAll();
+        }
+        onTopologyChanged();
+    }
+
+    void subdivideAll() {
+        std::vector<uint32_t> leaves = leafIndices(), newLeaves;
+        splitLeaves(leaves, [](uint32_t) { return true; }, newLeaves);
+    }
+
+    std::vector<uint32_t> leafIndices() const {
+        std::vector<uint32_t> leaves;
+        leaves.reserve((m_nodes.size() + 1) / 2);
+        for (uint32_t i = 0; i < (uint32_t)m_nodes.size(); ++i) {
+            if (m_nodes[i].isLeaf) {
+                leaves.push_back(i);
+            }
+        }
+        return leaves;
+    }
+
+    // Splits all of the given leaves for which shallSplit(nodeIndex) holds and appends the indices
+    // of their children to newLeaves. The decisions are made in parallel, exclusive prefix sums over
+    // them assign the new nodes and D-trees their slots, and the new entries are then filled in parallel.
+    template<typename TPredicate>
+    void splitLeaves(const std::vector<uint32_t>& leaves, const TPredicate& shallSplit, std::vector<uint32_t>& newLeaves) {
+        const int nLeaves = (int)leaves.size();
+        std::vector<uint32_t> slots(nLeaves + 1, 0);
+        std::vector<uint32_t> dTreeSlots(nLeaves + 1, 0);
+
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < nLeaves; ++i) {
+            if (shallSplit(leaves[i])) {
+                slots[i + 1] = 1;
+                // Lazily allocated leaves have no D-tree to copy yet.
+                dTreeSlots[i + 1] = m_nodes[leaves[i]].dTreeIndex.load(std::memory_order_relaxed) != DTreeWrapperPool::UNALLOCATED ? 1 : 0;
+            }
+        }
+
+        for (int i = 0; i < nLeaves; ++i) {
+            slots[i + 1] += slots[i];
+            dTreeSlots[i + 1] += dTreeSlots[i];
+        }
+
+        size_t nSplits = slots[nLeaves];
+        const size_t maxSplits = (std::numeric_limits<uint32_t>::max() - m_nodes.size()) / 2;
+        if (nSplits > maxSplits) {
+            SLog(EWarn, "DTreeWrapper hit maximum children count.");
+            nSplits = maxSplits;
+        }
+
+        if (nSplits == 0) {
+            return;
+        }
+
+        const uint32_t firstNode = (uint32_t)m_nodes.size();
+        const uint32_t firstDTree = (uint32_t)m_dTrees.size();
+        m_nodes.resize(m_nodes.size() + 2 * nSplits);
+        m_dTrees.resize(m_dTrees.size() + dTreeSlots[nLeaves]);
+
+        // Leaves that are still unallocated may claim their D-tree at any time.
+        m_dTrees.reserve((m_nodes.size() + 1) / 2);
+
+        const size_t firstNewLeaf = newLeaves.size();
+        newLeaves.resize(firstNewLeaf + 2 * nSplits);
+
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < nLeaves; ++i) {
+            const uint32_t slot = slots[i];
+            if (slot == slots[i + 1] || slot >= nSplits) {
+                continue;
+            }
+
+            STreeNode& cur = m_nodes[leaves[i]];
+            const uint32_t dTreeIdx = cur.dTreeIndex.load(std::memory_order_relaxed);
+            uint32_t childDTreeIdx[2] = {dTreeIdx, dTreeIdx};
+            if (dTreeIdx != DTreeWrapperPool::UNALLOCATED) {
+                // The first child takes over the D-tree of its parent and the second one gets a copy of it,
+                // so the D-tree array stays free of holes.
+                DTreeWrapper& dTree = m_dTrees[dTreeIdx];
+                dTree.setStatisticalWeightBuilding(dTree.statisticalWeightBuilding() / 2);
+                dTree.setActualStatisticalWeightBuilding(dTree.actualStatisticalWeightBuilding() / 2);
+                // The statistics only describe the split that is happening right now.
+                dTree.clearSplitStatistics();
+                childDTreeIdx[1] = firstDTree + dTreeSlots[i];
+                m_dTrees[childDTreeIdx[1]] = dTree;
+            }
+
+            for (int j = 0; j < 2; ++j) {
+                const uint32_t idx = firstNode + 2 * slot + j;
+                cur.children[j] = idx;
+                m_nodes[idx].axis = (cur.axis + 1) % 3;
+                m_nodes[idx].level = cur.level + 1;
+                m_nodes[idx].dTreeIndex.store(childDTreeIdx[j], std::memory_order_relaxed);
+                newLeaves[firstNewLeaf + 2 * slot + j] = idx;
+            }
+            cur.isLeaf = false;
+        }
+    }
+
+    // Returns the index of the leaf that contains p and its size. On return, p is relative to the leaf.
+    uint32_t leafIndex(Point& p, Vector& size) const {
+        size = m_aabb.getExtents();
+        p = Point(p - m_aabb.min);
+        p.x /= size.x;
+        p.y /= size.y;
+        p.z /= size.z;
+
+        // Skip the top levels through the lookup grid. Out-of-range coordinates (and NaNs) are
+        // clamped to the same border cells that the descent below would end up in, and the
+        // remapping into the frame of the cached node is exact, just like halving level by level.
+        const int res = 1 << m_lookupGridLevels;
+        int cell[3];
+        for (int a = 0; a < 3; ++a) {
+            const Float x = p[a] * res;
+            cell[a] = x < res ? (x >= 0 ? (int)x : 0) : res - 1;
+        }
+
+        uint32_t nodeIdx = m_lookupGrid[(cell[2] * res + cell[1]) * res + cell[0]];
+        for (int a = 0; a < 3; ++a) {
+            const int splits = m_nodes[nodeIdx].splits(a);
+            p[a] = p[a] * (1 << splits) - (cell[a] >> (m_lookupGridLevels - splits));
+            size[a] /= (1 << splits);
+        }
+
+        while (!m_nodes[nodeIdx].isLeaf) {
+            const STreeNode& node = m_nodes[nodeIdx];
+            SAssert(p[node.axis] >= 0 && p[node.axis] <= 1);
+            size[node.axis] /= 2;
+            nodeIdx = node.nodeIndex(p);
+        }
+
+        return nodeIdx;
+    }
+
+    DTreeWrapper* dTreeWrapper(Point p, Vector& size) {
+        const Point pWorld = p;
+        return claimDTree(m_nodes[leafIndex(p, size)], pWorld, p, size);
+    }
+
+    DTreeWrapper* dTreeWrapper(Point p) {
+        Vector size;
+        return dTreeWrapper(p, size);
+    }
+
+    // Compact reference to the leaf that a point was last found in. It remains valid until that leaf
+    // is split or the nodes are moved around, so repeated lookups of the same point can skip the descent.
+    struct LeafHandle {
+        LeafHandle() : nodeIdx(0), generation(0) {
+        }
+
+        uint32_t nodeIdx;
+        uint32_t generation;
+    };
+
+    // Same as dTreeWrapper(p, size), but reuses the leaf of a valid handle and updates an invalid one.
+    DTreeWrapper* dTreeWrapper(const Point& p, Vector& size, LeafHandle& handle) {
+        if (handle.generation == m_generation && m_nodes[handle.nodeIdx].isLeaf) {
+            const STreeNode& node = m_nodes[handle.nodeIdx];
+            const Vector extents = m_aabb.getExtents();
+            for (int a = 0; a < 3; ++a) {
+                size[a] = extents[a] / (1 << node.splits(a));
+            }
+
+            // The D-tree of the leaf was claimed when the handle was made.
+            return &m_dTrees.at(m_nodes[handle.nodeIdx].dTreeIndex);
+        }
+
+        Point local = p;
+        handle.nodeIdx = leafIndex(local, size);
+        handle.generation = m_generation;
+        return claimDTree(m_nodes[handle.nodeIdx], p, local, size);
+    }
+
+    // Read-only lookup that never allocates a D-tree; unallocated leaves yield the prototype.
+    const DTreeWrapper* dTreeWrapper(Point p, Vector& size) const {
+        return &m_dTrees.at(m_nodes[leafIndex(p, size)].dTreeIndex);
+    }
+
+    // The learned radiance arriving at p from direction d, interpolated trilinearly between the centers of
+    // the leaves around p and bilinearly between the directional leaves around d. Leaves that have not
+    // seen any samples yet are left out of the interpolation. Only the sampling trees are read, so this
+    // is safe to call per bounce while the building trees are being recorded into.
+    Float radiance(const Point& p, const Vector& d) const {
+        const Point2 canonical = DTreeWrapper::dirToCanonical(d);
+
+        Vector size;
+        Point local = p;
+        const DTreeWrapper* center = dTreeWrapper(local, size);
+
+        // Offset towards the neighbor whose center is closest, and the weight of that neighbor per axis.
+        Vector offset, t;
+        for (int a = 0; a < 3; ++a) {
+            const Float x = std::min(std::max(local[a], 0.0f), 1.0f) - 0.5f;
+            offset[a] = x < 0 ? -size[a] : size[a];
+            t[a] = std::abs(x);
+            if (!(p[a] + offset[a] >= m_aabb.min[a] && p[a] + offset[a] <= m_aabb.max[a])) {
+                t[a] = 0;
+            }
+        }
+
+        const DTreeWrapper* dTrees[8];
+        Float values[8];
+        Float result = 0, weightSum = 0;
+        for (int i = 0; i < 8; ++i) {
+            Float weight = 1;
+            Point q = p;
+            for (int a = 0; a < 3; ++a) {
+                const bool neighbor = (i >> a) & 1;
+                weight *= neighbor ? t[a] : 1 - t[a];
+                if (neighbor) {
+                    q[a] += offset[a];
+                }
+            }
+
+            dTrees[i] = nullptr;
+            if (!(weight > 0)) {
+                continue;
+            }
+
+            Vector neighborSize;
+            dTrees[i] = i == 0 ? center : dTreeWrapper(q, neighborSize);
+
+            // Neighbors are frequently one and the same (coarser) leaf.
+            int j = 0;
+            while (dTrees[j] != dTrees[i]) {
+                ++j;
+            }
+            values[i] = j < i ? values[j] : dTrees[i]->radiance(canonical);
+
+            if (dTrees[i]->statisticalWeight() > 0) {
+                result += weight * values[i];
+                weightSum += weight;
+            }
+        }
+
+        return weightSum > 0 ? result / weightSum : 0;
+    }
+
+    // Gives the sampling tree of every D-tree a copy per NUMA node. Each node's copies are made by one thread
+    // per CPU of that node, all bound to it, such that (with the usual first-touch policy) their memory is local
+    // to the node. The threads of a node take the D-trees in chunks. Returns the number of nodes that were
+    // replicated, which is 0 on single-node machines.
+    int replicateSamplingTrees() {
+        const int nNodes = NumaTopology::nodeCount();
+        if (nNodes < 2) {
+            return 0;
+        }
+
+        forEachDTreeWrapperParallel([nNodes](DTreeWrapper* dTree) { dTree->reserveSamplingReplicas(nNodes); });
+
+        static const size_t CHUNK_SIZE = 64;
+        std::unique_ptr<std::atomic<size_t>[]> nextDTree(new std::atomic<size_t>[nNodes]);
+        std::atomic<int> nBound(0);
+        std::vector<std::thread> threads;
+        for (int node = 0; node < nNodes; ++node) {
+            nextDTree[node] = 0;
+            const int nThreads = std::max(NumaTopology::cpuCount(node), 1);
+            for (int t = 0; t < nThreads; ++t) {
+                threads.emplace_back([this, node, t, &nextDTree, &nBound]() {
+                    if (NumaTopology::bindCurrentThread(node) && t == 0) {
+                        ++nBound;
+                    }
+
+                    const size_t nDTrees = m_dTrees.size();
+                    for (size_t begin = nextDTree[node].fetch_add(CHUNK_SIZE); begin < nDTrees;
+                        begin = nextDTree[node].fetch_add(CHUNK_SIZE)) {
+                        const size_t end = std::min(begin + CHUNK_SIZE, nDTrees);
+                        for (size_t i = begin; i < end; ++i) {
+                            m_dTrees[i].replicateSampling(node);
+                        }
+                    }
+                    if (t == 0 && m_lazyDTrees) {
+                        m_dTrees.prototype().replicateSampling(node);
+                    }
+                });
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        return nBound;
+    }
+
+    // Only visits allocated D-trees, i.e. not the prototype that stands in for lazily allocated leaves.
+    void forEachDTreeWrapperConst(std::function<void(const DTreeWrapper*)> func) const {
+        for (size_t i = 0; i < m_dTrees.size(); ++i) {
+            func(&m_dTrees[i]);
+        }
+    }
+
+    void forEachDTreeWrapperConstP(std::function<void(const DTreeWrapper*, const Point&, const Vector&)> func) const {
+        m_nodes[0].forEachLeaf(func, m_aabb.min, m_aabb.max - m_aabb.min, m_nodes, m_dTrees);
+    }
+
+    void forEachDTreeWrapperParallel(std::function<void(DTreeWrapper*)> func) {
+        int nDTreeWrappers = static_cast<int>(m_dTrees.size());
+
+        // The cost per D-tree varies wildly with its size.
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int i = 0; i < nDTreeWrappers; ++i) {
+            func(&m_dTrees[i]);
+        }
+
+        if (m_lazyDTrees) {
+            func(&m_dTrees.prototype());
+        }
+    }
+
+    // Splats the record into every leaf that overlaps the box of size dTreeVoxelSize around p, weighted by the
+    // volume of the overlap. The overlapping leaves are gathered first, so that the direction of the record
+    // only needs to be mapped once for all of them.
+    void record(const Point& p, const Vector& dTreeVoxelSize, DTreeRecord rec, 
+        EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, Float actualSW) {
+        Float volume = 1;
+        for (int i = 0; i < 3; ++i) {
+            volume *= dTreeVoxelSize[i];
+        }
+
+        rec.statisticalWeight /= volume;
 
-        return {(cosTheta + 1) / 2, phi / (2 * M_PI)};
+        InlineStack<LeafOverlap, 64> overlaps;
+        collectOverlappingLeaves(p - dTreeVoxelSize * 0.5f, p + dTreeVoxelSize * 0.5f, overlaps);
+        if (overlaps.empty()) {
+            return;
+        }
+
+        const Point2 canonical = DTreeWrapper::dirToCanonical(rec.d);
+        const Float statisticalWeight = rec.statisticalWeight;
+        DTreeSplatBuffer* buffer = splatBuffer();
+        while (!overlaps.empty()) {
+            const LeafOverlap overlap = overlaps.pop();
+            rec.statisticalWeight = statisticalWeight * overlap.volume;
+            overlap.dTree->record(rec, canonical, directionalFilter, bsdfSamplingFractionLoss, actualSW, buffer);
+        }
     }
 
-    void computeRequiredSamples(ref<Sampler> sampler){
-        if(B < EPSILON){
-            req_augmented_samples = 0;
+    void dump(BlobWriter& blob) const {
+        forEachDTreeWrapperConstP([&blob](const DTreeWrapper* dTree, const Point& p, const Vector& size) {
+            if (dTree->statisticalWeight() > 0) {
+                dTree->dump(blob, p, size);
+            }
+        });
+    }
+
+    bool shallSplit(const STreeNode& node, size_t samplesRequired) const {
+        const DTreeWrapper& dTree = m_dTrees.at(node.dTreeIndex);
+        return dTree.actualStatisticalWeightBuilding() > samplesRequired &&
+            (m_splitDivergenceThreshold <= 0 || dTree.splitDivergence() > m_splitDivergenceThreshold);
+    }
+
+    // With a positive threshold, leaves are only split once their two would-be children saw sufficiently
+    // different light (see DTreeWrapper::splitDivergence()), on top of having enough samples. Leaves
+    // created by a split have no such statistics yet, so they grow at most one level per refinement.
+    void setSplitDivergenceThreshold(Float threshold) {
+        m_splitDivergenceThreshold = threshold;
+        updateSplitStatistics();
+    }
+
+    size_t approxMemoryFootprint() const {
+        // D-trees of different wrappers may share their storage as well (e.g. right after subdivision).
+        std::unordered_set<const void*> countedStorage;
+        size_t result = m_nodes.capacity() * sizeof(STreeNode) + m_lookupGrid.capacity() * sizeof(uint32_t);
+        for (size_t i = 0; i < m_dTrees.size(); ++i) {
+            result += m_dTrees[i].approxMemoryFootprint(countedStorage);
         }
-        else{
-            float req = B * weighted_previous_samples.load();
-            float frac = req - int(req);
-            req_augmented_samples = req;
-            if(sampler->next1D() < frac){
-                req_augmented_samples++;
+        return result;
+    }
+
+    // With maxMB >= 0, the SD-tree is kept within a budget of maxMB megabytes: if it is over budget,
+    // the sibling leaves with the least energy are merged, otherwise the leaves that exceed sTreeThreshold
+    // are split in order of decreasing energy for as long as the budget allows it. The D-trees of the
+    // resulting leaves are then fit into the budget by resetDTrees().
+    void refine(size_t sTreeThreshold, int maxMB, bool staticSTree) {
+        if (staticSTree) {
+            return;
+        }
+
+        const bool budgeted = maxMB >= 0;
+        const size_t budget = (size_t)std::max(maxMB, 0) * 1000000;
+        size_t footprint = budgeted ? approxMemoryFootprint() : 0;
+        if (budgeted && footprint > budget) {
+            mergeLowEnergyLeaves(footprint - budget);
+            onTopologyChanged();
+            return;
+        }
+
+        // Split in rounds: every leaf created in one round (which inherits half the weight of its
+        // parent) is tested again in the next one, until no leaf exceeds the threshold any more.
+        std::vector<uint32_t> leaves = leafIndices(), newLeaves;
+        std::vector<bool> accepted;
+        while (!leaves.empty()) {
+            newLeaves.clear();
+            if (!budgeted) {
+                splitLeaves(leaves, [this, sTreeThreshold](uint32_t nodeIdx) {
+                    return shallSplit(m_nodes[nodeIdx], sTreeThreshold);
+                }, newLeaves);
+            } else {
+                struct Candidate {
+                    uint32_t nodeIdx;
+                    Float energy;
+                };
+
+                std::vector<Candidate> candidates;
+                for (uint32_t nodeIdx : leaves) {
+                    if (shallSplit(m_nodes[nodeIdx], sTreeThreshold)) {
+                        candidates.push_back({nodeIdx, m_dTrees.at(m_nodes[nodeIdx].dTreeIndex).energy()});
+                    }
+                }
+
+                std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+                    return a.energy > b.energy;
+                });
+
+                // A split costs two nodes and (eventually, once it is no longer shared) a second D-tree.
+                accepted.assign(m_nodes.size(), false);
+                for (const auto& candidate : candidates) {
+                    std::unordered_set<const void*> countedStorage;
+                    const size_t cost = 2 * sizeof(STreeNode) +
+                        m_dTrees.at(m_nodes[candidate.nodeIdx].dTreeIndex).approxMemoryFootprint(countedStorage);
+                    if (footprint + cost > budget) {
+                        break;
+                    }
+
+                    footprint += cost;
+                    accepted[candidate.nodeIdx] = true;
+                }
+
+                splitLeaves(leaves, [&accepted](uint32_t nodeIdx) {
+                    return accepted[nodeIdx];
+                }, newLeaves);
             }
+            std::swap(leaves, newLeaves);
         }
+
+        // Uncomment once memory becomes an issue.
+        //m_nodes.shrink_to_fit();
+
+        onTopologyChanged();
     }
 
-    void addWeightedSampleCount(float wsc){
-        addToAtomicFloat(weighted_previous_samples, wsc);
+    /**
+        Resets all D-trees for the next iteration (see DTreeWrapper::reset). With maxMB >= 0, they also
+        give up the subdivisions that no longer carry enough energy, and as long as the SD-tree still
+        exceeds the budget afterwards, the subdivision threshold is doubled and the D-trees are reset
+        again. This keeps the quadrants with the largest share of energy in every D-tree and drops
+        the others, until the tree fits or the D-trees do not subdivide any more.
+    */
+    void resetDTrees(int maxDepth, Float subdivisionThreshold, bool augment, int maxMB) {
+        const bool budgeted = maxMB >= 0;
+        const size_t budget = (size_t)std::max(maxMB, 0) * 1000000;
+
+        Float threshold = subdivisionThreshold;
+        while (true) {
+            forEachDTreeWrapperParallel([maxDepth, threshold, augment, budgeted](DTreeWrapper* dTree) {
+                dTree->reset(maxDepth, threshold, augment, budgeted);
+            });
+
+            if (!budgeted || threshold >= 1 || approxMemoryFootprint() <= budget) {
+                break;
+            }
+
+            threshold = threshold > 0 ? std::min(2 * threshold, (Float)1) : (Float)0.001;
+        }
+
+        if (threshold != subdivisionThreshold) {
+            SLog(EInfo, "Raised the D-tree subdivision threshold to %f to stay within the memory budget.", threshold);
+        }
     }
 
-    void build(bool augment, bool augmentReweight, bool isBuilt, ref<Sampler> sampler, bool samplesSaved, bool sampleless_aug = false) {
-        previous = sampling;
-        if(sampleless_aug){
-            if(augment && isBuilt){
-                float factor = req_augmented_samples == 0 ? 
-                    0.f : std::min(double(current_samples) / req_augmented_samples, 1.0);
+    const AABB& aabb() const {
+        return m_aabb;
+    }
 
-                total_samples *= factor;
+private:
+    // Collapses pairs of sibling leaves into their parent, in order of increasing energy, until at least
+    // `excess` bytes are freed. The parent takes over the D-tree of the sibling that saw more samples
+    // together with the statistical weight of both.
+    void mergeLowEnergyLeaves(size_t excess) {
+        struct Candidate {
+            uint32_t nodeIdx;
+            Float energy;
+        };
 
-                building.blend(sampling, factor);
+        std::vector<Candidate> candidates;
+        for (uint32_t i = 0; i < (uint32_t)m_nodes.size(); ++i) {
+            const STreeNode& node = m_nodes[i];
+            if (!node.isLeaf && m_nodes[node.children[0]].isLeaf && m_nodes[node.children[1]].isLeaf) {
+                candidates.push_back({i, m_dTrees.at(m_nodes[node.children[0]].dTreeIndex).energy() +
+                    m_dTrees.at(m_nodes[node.children[1]].dTreeIndex).energy()});
             }
+        }
 
-            total_samples += current_samples;
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.energy < b.energy;
+        });
+
+        size_t freed = 0;
+        size_t nMerged = 0;
+        for (const auto& candidate : candidates) {
+            if (freed >= excess) {
+                break;
+            }
+
+            STreeNode& node = m_nodes[candidate.nodeIdx];
+            const uint32_t idx[2] = {
+                m_nodes[node.children[0]].dTreeIndex.load(std::memory_order_relaxed),
+                m_nodes[node.children[1]].dTreeIndex.load(std::memory_order_relaxed),
+            };
+
+            // Lazily allocated leaves cost nothing and carry nothing.
+            uint32_t kept = idx[0], dropped = idx[1];
+            if (kept == DTreeWrapperPool::UNALLOCATED || (dropped != DTreeWrapperPool::UNALLOCATED &&
+                m_dTrees[dropped].actualStatisticalWeightBuilding() > m_dTrees[kept].actualStatisticalWeightBuilding())) {
+                std::swap(kept, dropped);
+            }
+
+            if (dropped != DTreeWrapperPool::UNALLOCATED) {
+                DTreeWrapper& dTree = m_dTrees[kept];
+                dTree.setStatisticalWeightBuilding(dTree.statisticalWeightBuilding() + m_dTrees[dropped].statisticalWeightBuilding());
+                dTree.setActualStatisticalWeightBuilding(dTree.actualStatisticalWeightBuilding() + m_dTrees[dropped].actualStatisticalWeightBuilding());
+
+                std::unordered_set<const void*> countedStorage;
+                freed += m_dTrees[dropped].approxMemoryFootprint(countedStorage);
+            }
+
+            node.isLeaf = true;
+            node.dTreeIndex.store(kept, std::memory_order_relaxed);
+            freed += 2 * sizeof(STreeNode);
+            ++nMerged;
         }
-        
 
-        /*if(min_nzradiance > 100000.f){
-            min_nzradiance = EPSILON * 2.f;
-        }*/
+        SLog(EInfo, "Merged " SIZE_T_FMT " pairs of low-energy STree leaves to stay within the memory budget.", nMerged);
+        compact();
+    }
 
-        building.setMinimumIrr(EPSILON * 10.f);
-        building.build();
-        
-        if((augment || augmentReweight) && isBuilt){
-            if(samplesSaved){
-                savedAug = sampling;
+    // Drops the nodes and D-trees that are no longer reachable from the root, e.g. after merging leaves.
+    void compact() {
+        std::vector<STreeNode> nodes;
+        std::vector<uint32_t> dTreeIndices;
+        nodes.reserve(m_nodes.size());
+        nodes.push_back(m_nodes[0]);
+
+        // Breadth-first, such that the children of every node end up next to each other.
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            STreeNode& node = nodes[i];
+            if (node.isLeaf) {
+                const uint32_t dTreeIdx = node.dTreeIndex.load(std::memory_order_relaxed);
+                if (dTreeIdx != DTreeWrapperPool::UNALLOCATED) {
+                    node.dTreeIndex.store((uint32_t)dTreeIndices.size(), std::memory_order_relaxed);
+                    dTreeIndices.push_back(dTreeIdx);
+                }
+                continue;
             }
 
-            if(augment){
-                B = augmented.buildAugmented(savedAug, building);
+            for (int j = 0; j < 2; ++j) {
+                const uint32_t child = node.children[j];
+                node.children[j] = (uint32_t)nodes.size();
+                nodes.push_back(m_nodes[child]);
+            }
+        }
 
-                if(sampleless_aug){
-                    if(B < EPSILON){
-                        req_augmented_samples = 0;
-                    }
-                    else{
-                        float req = B * total_samples;
-                        float frac = req - int(req);
-                        req_augmented_samples = req;
-                        if(sampler->next1D() < frac){
-                            req_augmented_samples++;
-                        }
+        DTreeWrapperPool dTrees;
+        dTrees.resize(dTreeIndices.size());
+        dTrees.reserve((nodes.size() + 1) / 2);
+        dTrees.prototype() = m_dTrees.prototype();
+
+        const int nDTrees = (int)dTreeIndices.size();
+#pragma omp parallel for
+        for (int i = 0; i < nDTrees; ++i) {
+            dTrees[i] = m_dTrees[dTreeIndices[i]];
+        }
+
+        m_nodes = std::move(nodes);
+        m_dTrees.swap(dTrees);
+
+        // Node indices changed, so all leaf handles are stale.
+        ++m_generation;
+    }
+
+    // The D-tree of the given leaf, which is found at the world space point p that lies at local within the leaf.
+    DTreeWrapper* claimDTree(STreeNode& leaf, const Point& p, const Point& local, const Vector& size) {
+        return &m_dTrees.at(leaf.dTreeIndex, [&](DTreeWrapper& claimed) {
+            if (m_splitDivergenceThreshold > 0) {
+                Point center;
+                for (int a = 0; a < 3; ++a) {
+                    center[a] = p[a] + (0.5f - local[a]) * size[a];
+                }
+                claimed.setSplitStatistics(true, center);
+            }
+        });
+    }
+
+    struct LeafOverlap {
+        DTreeWrapper* dTree;
+        Float volume;
+    };
+
+    // Finds the D-trees of all leaves that overlap the box [boxMin, boxMax] (claiming lazily allocated ones)
+    // together with the volume of the overlap. Boxes within a single cell of the lookup grid start from the
+    // node cached there; the overlaps are clipped with SIMD.
+    template <size_t N>
+    void collectOverlappingLeaves(const Point& boxMin, const Point& boxMax, InlineStack<LeafOverlap, N>& overlaps) {
+        struct Entry {
+            uint32_t nodeIdx;
+            Point origin;
+            Vector size;
+        };
+
+        Entry start{0, m_aabb.min, m_aabb.getExtents()};
+        const Vector extents = m_aabb.getExtents();
+        const int res = 1 << m_lookupGridLevels;
+        int cellMin[3], cellMax[3];
+        bool singleCell = true;
+        for (int a = 0; a < 3; ++a) {
+            const Float lo = (boxMin[a] - m_aabb.min[a]) / extents[a] * res;
+            const Float hi = (boxMax[a] - m_aabb.min[a]) / extents[a] * res;
+            cellMin[a] = lo < res ? (lo >= 0 ? (int)lo : 0) : res - 1;
+            cellMax[a] = hi < res ? (hi >= 0 ? (int)hi : 0) : res - 1;
+            singleCell &= cellMin[a] == cellMax[a];
+        }
+
+        if (singleCell) {
+            start.nodeIdx = m_lookupGrid[(cellMin[2] * res + cellMin[1]) * res + cellMin[0]];
+            const STreeNode& node = m_nodes[start.nodeIdx];
+            for (int a = 0; a < 3; ++a) {
+                const int splits = node.splits(a);
+                start.size[a] = extents[a] / (1 << splits);
+                start.origin[a] = m_aabb.min[a] + start.size[a] * (cellMin[a] >> (m_lookupGridLevels - splits));
+            }
+        }
+
+        const bool splitStatistics = m_splitDivergenceThreshold > 0;
+#ifdef MTS_SSE
+        const __m128 boxMinPs = _mm_setr_ps(boxMin.x, boxMin.y, boxMin.z, 0);
+        const __m128 boxMaxPs = _mm_setr_ps(boxMax.x, boxMax.y, boxMax.z, 0);
+#endif
+
+        InlineStack<Entry, 64> stack;
+        stack.push(start);
+        while (!stack.empty()) {
+            Entry entry = stack.pop();
+
+#ifdef MTS_SSE
+            const __m128 nodeMin = _mm_setr_ps(entry.origin.x, entry.origin.y, entry.origin.z, 0);
+            const __m128 nodeMax = _mm_add_ps(nodeMin, _mm_setr_ps(entry.size.x, entry.size.y, entry.size.z, 0));
+            const SSEVector lengths(_mm_max_ps(_mm_sub_ps(_mm_min_ps(boxMaxPs, nodeMax), _mm_max_ps(boxMinPs, nodeMin)), _mm_setzero_ps()));
+            const Float volume = lengths.f[0] * lengths.f[1] * lengths.f[2];
+#else
+            Float volume = 1;
+            for (int a = 0; a < 3; ++a) {
+                volume *= std::max(std::min(boxMax[a], entry.origin[a] + entry.size[a]) - std::max(boxMin[a], entry.origin[a]), 0.0f);
+            }
+#endif
+            if (!(volume > 0)) {
+                continue;
+            }
+
+            STreeNode& node = m_nodes[entry.nodeIdx];
+            if (node.isLeaf) {
+                DTreeWrapper& dTree = m_dTrees.at(node.dTreeIndex, [&](DTreeWrapper& claimed) {
+                    if (splitStatistics) {
+                        claimed.setSplitStatistics(true, entry.origin + entry.size * 0.5f);
                     }
+                });
+                overlaps.push(LeafOverlap{&dTree, volume});
+                continue;
+            }
+
+            entry.size[node.axis] /= 2;
+            stack.push(Entry{node.children[0], entry.origin, entry.size});
+            entry.origin[node.axis] += entry.size[node.axis];
+            stack.push(Entry{node.children[1], entry.origin, entry.size});
+        }
+    }
+
+    void onTopologyChanged() {
+        buildLookupGrid();
+        updateSplitStatistics();
+    }
+
+    // Moves the split statistics of every allocated leaf onto the center of its (possibly new) box,
+    // or disables them.
+    void updateSplitStatistics() {
+        struct Entry {
+            uint32_t nodeIdx;
+            Point origin;
+            Vector size;
+        };
+
+        const bool enabled = m_splitDivergenceThreshold > 0;
+        std::vector<Entry> stack;
+        stack.push_back({0, m_aabb.min, m_aabb.getExtents()});
+        while (!stack.empty()) {
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            const STreeNode& node = m_nodes[entry.nodeIdx];
+            if (node.isLeaf) {
+                const uint32_t dTreeIndex = node.dTreeIndex.load(std::memory_order_relaxed);
+                if (dTreeIndex < DTreeWrapperPool::CLAIMING) {
+                    m_dTrees[dTreeIndex].setSplitStatistics(enabled, entry.origin + entry.size * 0.5f);
                 }
+                continue;
             }
-            else if(augmentReweight){
-                B = augmented.buildUnmajorizedAugmented(savedAug, building);
+
+            entry.size[node.axis] /= 2;
+            stack.push_back({node.children[0], entry.origin, entry.size});
+            entry.origin[node.axis] += entry.size[node.axis];
+            stack.push_back({node.children[1], entry.origin, entry.size});
+        }
+    }
+
+    // Caches, for every cell of a uniform grid with 2^m_lookupGridLevels cells per axis, the deepest node
+    // of the top 3 * m_lookupGridLevels tree levels that contains the cell. Has to be rebuilt whenever
+    // the topology of the tree changes.
+    void buildLookupGrid() {
+        int maxLevel = 0;
+        for (const auto& node : m_nodes) {
+            maxLevel = std::max(maxLevel, (int)node.level);
+        }
+
+        m_lookupGridLevels = std::min(MAX_LOOKUP_GRID_LEVELS, maxLevel / 3);
+        const int res = 1 << m_lookupGridLevels;
+        const int nCells = res * res * res;
+        m_lookupGrid.resize(nCells);
+
+#pragma omp parallel for
+        for (int i = 0; i < nCells; ++i) {
+            const int cell[3] = {i % res, (i / res) % res, i / (res * res)};
+            int splits[3] = {0, 0, 0};
+
+            uint32_t nodeIdx = 0;
+            while (!m_nodes[nodeIdx].isLeaf && m_nodes[nodeIdx].level < 3 * m_lookupGridLevels) {
+                const STreeNode& node = m_nodes[nodeIdx];
+                const int bit = (cell[node.axis] >> (m_lookupGridLevels - 1 - splits[node.axis])) & 1;
+                ++splits[node.axis];
+                nodeIdx = node.children[bit];
             }
+
+            m_lookupGrid[i] = nodeIdx;
         }
+    }
 
-        if(!sampleless_aug){
-            req_augmented_samples = 0;
+    // 2^18 cells, i.e. 1 MB of node indices at most.
+    static const int MAX_LOOKUP_GRID_LEVELS = 6;
+
+    std::vector<STreeNode> m_nodes;
+    // Changes whenever existing nodes move, which invalidates all LeafHandles. Splits do not count,
+    // since they leave the other nodes in place and handles detect them through isLeaf.
+    uint32_t m_generation;
+    DTreeWrapperPool m_dTrees;
+    bool m_lazyDTrees;
+    std::vector<uint32_t> m_lookupGrid;
+    int m_lookupGridLevels;
+    Float m_splitDivergenceThreshold;
+    AABB m_aabb;
+    bool m_threadLocalSplatting;
+    mutable DTreeSplatBufferSet m_splatBuffers;
+};
+
+const int STree::MAX_LOOKUP_GRID_LEVELS;
+
+// Collects the records of a block of paths so that they can be committed grouped by D-tree. Consecutive
+// splats then stay within the same few (warm) D-tree nodes instead of jumping across the whole SD-tree.
+class DTreeRecordQueue {
+public:
+    void push(DTreeWrapper* dTree, const DTreeRecord& rec, Float actualSW) {
+        m_records.push_back(Entry{dTree, rec, actualSW, Point2(0.0f)});
+    }
+
+    size_t size() const {
+        return m_records.size();
+    }
+
+    void commit(STree& sdTree, EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss) {
+        m_dirs.resize(m_records.size());
+        m_canonicals.resize(m_records.size());
+        for (size_t i = 0; i < m_records.size(); ++i) {
+            m_dirs[i] = m_records[i].rec.d;
+        }
+        DTreeWrapper::dirToCanonical(m_dirs.data(), m_canonicals.data(), m_records.size());
+        for (size_t i = 0; i < m_records.size(); ++i) {
+            m_records[i].canonical = m_canonicals[i];
         }
 
-        current_samples = 0;
-        setAtomicFloat(weighted_previous_samples, 0.f);
+        // The sort is stable such that every D-tree (and its sampling fraction optimizer)
+        // still receives its records in the order in which they were generated.
+        std::stable_sort(m_records.begin(), m_records.end(), [](const Entry& a, const Entry& b) {
+            return std::less<DTreeWrapper*>()(a.dTree, b.dTree);
+        });
 
-        sampling = building;
-        m_rejPdfPair = previous.getMajorizingFactor(sampling);
+        DTreeSplatBuffer* splatBuffer = sdTree.splatBuffer();
+        for (const auto& entry : m_records) {
+            entry.dTree->record(entry.rec, entry.canonical, directionalFilter, bsdfSamplingFractionLoss, entry.actualSW, splatBuffer);
+        }
+
+        m_records.clear();
+    }
+
+private:
+    struct Entry {
+        DTreeWrapper* dTree;
+        DTreeRecord rec;
+        Float actualSW;
+        Point2 canonical;
+    };
+
+    std::vector<Entry> m_records;
+
+    // Scratch space for the batched direction mapping
+    std::vector<Vector> m_dirs;
+    std::vector<Point2> m_canonicals;
+};
+
+struct RVertex{
+    Point o;
+    Vector d;
+    Float time;
+    Spectrum bsdfVal;
+    Float bsdfPdf, woPdf;
+    bool isDelta;
+    float sc;
+    // Leaf of the SD-tree that o was last looked up in.
+    STree::LeafHandle leaf;
+};
+
+struct RadRecord{
+    int pos;
+    Spectrum L;
+    float pdf;
+};
+
+struct NEERecord{
+    int pos;
+    Spectrum L;
+    float pdf;
+    Vector wo;
+    Spectrum bsdfVal;
+    Float bsdfPdf;
+};
+
+// Built by Li() for a single sample and then appended to an RPathArena.
+struct RPath{
+    std::vector<RVertex> path;
+    std::vector<RadRecord> radiance_records;
+    std::vector<NEERecord> nee_records;
+    Point2 sample_pos;
+    bool active;
+    std::int8_t iter;
+
+    void clear() {
+        path.clear();
+        radiance_records.clear();
+        nee_records.clear();
     }
+};
+
+// A vertex of a stored path. The fields that reuse passes update refer into the arrays of its
+// RPathArena segment; the others are copies, decoded first if the segment is compact.
+struct RVertexRef{
+    Point o;
+    Vector d;
+    Float time;
+    Spectrum bsdfVal;
+    Float bsdfPdf;
+    Float& woPdf;
+    bool isDelta;
+    float& sc;
+    STree::LeafHandle& leaf;
+};
+
+/**
+    Stores the sample paths that are reused across iterations. Every rendered block
+    appends its paths to a segment of its own, which keeps one flat array per vertex
+    field, and publishes it into the slots it reserved, so blocks never contend for
+    the arena. Passes over the stored paths read the fields they need linearly
+    instead of chasing the vectors of individual paths.
+
+    Compact arenas quantize the read-only fields of each vertex, which brings
+    it from 61 down to 44 bytes (including the leaf handle):
+    - The position is stored with 21 bits per axis relative to the bounds of the
+      arena, i.e. the error per axis is at most 2^-22 of the bounds' extent. The
+      delta flag takes the remaining bit. Positions outside of the bounds are
+      clamped to them.
+    - The direction is octahedrally encoded in 2x16 bits, with an angular error
+      below 1e-4 radians. Zero and non-finite directions decode to +z.
+    - The BSDF value is stored as 16 bit mantissas with a shared exponent, so the
+      error of every channel is at most 2^-16 of the largest channel. Negative
+      channels are stored as zero, and spectra with a NaN or infinitely large
+      channel as black.
+    The BSDF pdf, time, sampling pdf and scale factor stay at full precision, the
+    latter two because the reuse passes update them again in every iteration.
+
+    Under a memory limit, segments that would exceed it are moved to temporary
+    memory-mapped spill files instead, so the operating system pages them in and
+    out as the passes stream through them. The per-path entries always stay in
+    memory.
+*/
+class RPathArena {
+public:
+    struct Segment;
+
+    // Bits per axis of a quantized position.
+    static const int POSITION_BITS = 21;
+    static const std::uint64_t POSITION_MAX = (std::uint64_t(1) << POSITION_BITS) - 1;
+    static const std::uint64_t DELTA_BIT = std::uint64_t(1) << 63;
+
+    struct PackedSpectrum {
+        std::uint16_t mantissas[SPECTRUM_SAMPLES];
+        std::int16_t exponent;
+    };
 
-    void reset(int maxDepth, Float subdivisionThreshold, bool augment) {
-        building.reset(sampling, maxDepth, subdivisionThreshold, augment);
-    }
+    static PackedSpectrum packSpectrum(const Spectrum& s) {
+        PackedSpectrum packed;
+        const Float max = s.max();
+        if (!(max > 0) || !std::isfinite(max) || s.isNaN()) {
+            std::fill(packed.mantissas, packed.mantissas + SPECTRUM_SAMPLES, 0);
+            packed.exponent = 0;
+            return packed;
+        }
 
-    Vector sample(Sampler* sampler, bool augment) const{
-        if(augment){
-            return current_samples >= req_augmented_samples ? canonicalToDir(sampling.sample(sampler)) : canonicalToDir(augmented.sample(sampler));
+        int exponent;
+        std::frexp(max, &exponent);
+        for (int i = 0; i < SPECTRUM_SAMPLES; ++i) {
+            const Float m = std::ldexp(std::max(s[i], (Float)0), 16 - exponent);
+            packed.mantissas[i] = (std::uint16_t)std::min(m + (Float)0.5, (Float)65535);
         }
-        else return canonicalToDir(sampling.sample(sampler));
+        packed.exponent = (std::int16_t)exponent;
+        return packed;
     }
 
-    void incSampleCount(){
-        current_samples++;
+    static Spectrum unpackSpectrum(const PackedSpectrum& packed) {
+        Spectrum s;
+        for (int i = 0; i < SPECTRUM_SAMPLES; ++i) {
+            s[i] = std::ldexp((Float)packed.mantissas[i], packed.exponent - 16);
+        }
+        return s;
     }
 
-    double getAugmentedMultiplier(){
-        return current_samples < req_augmented_samples ? current_samples / double(req_augmented_samples) : 1;
+    // Packs octahedral coordinates in [-1, 1]^2.
+    static std::uint32_t packOctahedral(Float u, Float v) {
+        const std::uint32_t qu = (std::uint32_t)(math::clamp(u * (Float)0.5 + (Float)0.5, (Float)0, (Float)1) * 65535 + (Float)0.5);
+        const std::uint32_t qv = (std::uint32_t)(math::clamp(v * (Float)0.5 + (Float)0.5, (Float)0, (Float)1) * 65535 + (Float)0.5);
+        return qu | (qv << 16);
     }
 
-    Float pdf(const Vector& dir, int level, int& curr_level, bool sampleless_aug = false) const {
-        if(sampleless_aug){
-            return current_samples >= req_augmented_samples ? 
-                sampling.pdf(dirToCanonical(dir), level, curr_level) : 
-                augmented.pdf(dirToCanonical(dir), level, curr_level);
-        } 
-        else{
-            return sampling.pdf(dirToCanonical(dir), level, curr_level);
+    static std::uint32_t packDirection(const Vector& d) {
+        const Float norm = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+        if (!(norm > 0) || !std::isfinite(norm)) {
+            return packOctahedral(0, 0);
         }
-    }
 
-    Float diff(const DTreeWrapper& other) const {
-        return 0.0f;
+        Float u = d.x / norm, v = d.y / norm;
+        if (d.z < 0) {
+            const Float su = u < 0 ? -1 : 1, sv = v < 0 ? -1 : 1;
+            const Float tu = (1 - std::abs(v)) * su;
+            v = (1 - std::abs(u)) * sv;
+            u = tu;
+        }
+        return packOctahedral(u, v);
     }
 
-    int depth() const {
-        return sampling.depth();
-    }
+    static Vector unpackDirection(std::uint32_t packed) {
+        const Float u = (packed & 0xFFFF) * ((Float)2 / 65535) - 1;
+        const Float v = (packed >> 16) * ((Float)2 / 65535) - 1;
+        Vector d(u, v, 1 - std::abs(u) - std::abs(v));
+        if (d.z < 0) {
+            d.x = (1 - std::abs(v)) * (u < 0 ? -1 : 1);
+            d.y = (1 - std::abs(u)) * (v < 0 ? -1 : 1);
+        }
+        return normalize(d);
+    }
+
+    struct PathEntry {
+        Segment* segment = nullptr;
+        std::uint32_t firstVertex = 0;
+        std::uint32_t firstRadiance = 0;
+        std::uint32_t firstNee = 0;
+        std::uint32_t numVertices = 0;
+        std::uint32_t numRadiance = 0;
+        std::uint32_t numNee = 0;
+        bool active = false;
+        std::int8_t iter = 0;
+    };
 
-    size_t numNodes() const {
-        return sampling.numNodes();
-    }
+    // An array of a segment. It is filled in memory and may then be moved to a spill file.
+    template <typename T>
+    class SegmentArray {
+    public:
+        SegmentArray() : m_data(nullptr), m_size(0) {
+        }
 
-    Float meanRadiance() const {
-        return sampling.mean();
-    }
+        void push_back(const T& value) {
+            m_values.push_back(value);
+            m_data = m_values.data();
+            ++m_size;
+        }
 
-    Float statisticalWeight() const {
-        return sampling.statisticalWeight();
-    }
+        template <typename Iterator>
+        void append(Iterator begin, Iterator end) {
+            m_values.insert(m_values.end(), begin, end);
+            m_data = m_values.data();
+            m_size = m_values.size();
+        }
 
-    Float statisticalWeightBuilding() const {
-        return building.statisticalWeight();
-    }
+        size_t size() const {
+            return m_size;
+        }
 
-    Float actualStatisticalWeightBuilding() const {
-        return building.actualStatisticalWeight();
-    }
+        T* data() const {
+            return m_data;
+        }
 
-    void setStatisticalWeightBuilding(Float statisticalWeight) {
-        building.setStatisticalWeight(statisticalWeight);
-    }
+        T& operator[](size_t i) const {
+            return m_data[i];
+        }
 
-    void setActualStatisticalWeightBuilding(Float statisticalWeight) {
-        building.setActualStatisticalWeight(statisticalWeight);
-    }
+        size_t bytes() const {
+            return m_size * sizeof(T);
+        }
 
-    size_t approxMemoryFootprint() const {
-        return building.approxMemoryFootprint() + sampling.approxMemoryFootprint();
-    }
+        void shrinkToFit() {
+            m_values.shrink_to_fit();
+            m_data = m_values.data();
+        }
 
-    inline Float bsdfSamplingFraction(Float variable) const {
-        return logistic(variable);
-    }
+        // Moves the values to dst, which must be suitably aligned and hold bytes() bytes.
+        void moveTo(char* dst) {
+            if (m_size > 0) {
+                std::memcpy(dst, m_values.data(), bytes());
+                m_data = reinterpret_cast<T*>(dst);
+            }
+            std::vector<T>().swap(m_values);
+        }
 
-    inline Float dBsdfSamplingFraction_dVariable(Float variable) const {
-        Float fraction = bsdfSamplingFraction(variable);
-        return fraction * (1 - fraction);
-    }
+    private:
+        std::vector<T> m_values;
+        T* m_data;
+        size_t m_size;
+    };
 
-    inline Float bsdfSamplingFraction() const {
-        return bsdfSamplingFraction(bsdfSamplingFractionOptimizer.variable());
+    // Alignment of the arrays of a segment within a spill file.
+    static const size_t SPILL_ALIGNMENT = 16;
+
+    static size_t alignSpill(size_t bytes) {
+        return (bytes + SPILL_ALIGNMENT - 1) & ~(SPILL_ALIGNMENT - 1);
     }
 
-    void optimizeBsdfSamplingFraction(const DTreeRecord& rec, Float ratioPower) {
-        m_lock.lock();
+    struct Segment {
+        Segment(bool compact, const AABB& bounds) : compact(compact), spillData(nullptr), spillBytes(0), prefetched(false), boundsMin(bounds.min) {
+            const Vector extents = bounds.getExtents();
+            for (int a = 0; a < 3; ++a) {
+                quantizationScale[a] = extents[a] > 0 ? POSITION_MAX / extents[a] : 0;
+                quantizationStep[a] = extents[a] / POSITION_MAX;
+            }
+        }
 
-        // GRADIENT COMPUTATION
-        Float variable = bsdfSamplingFractionOptimizer.variable();
-        Float samplingFraction = bsdfSamplingFraction(variable);
+        bool compact;
+        // The range of the spill file that holds the arrays, if the segment has been spilled.
+        char* spillData;
+        size_t spillBytes;
+        // Whether the current pass has already asked for the spilled range to be read in.
+        std::atomic<bool> prefetched;
+
+        Point boundsMin;
+        Vector quantizationScale;
+        Vector quantizationStep;
+
+        // Read-only fields at full precision...
+        SegmentArray<Point> positions;
+        SegmentArray<Vector> directions;
+        SegmentArray<Spectrum> bsdfVals;
+        SegmentArray<std::uint8_t> deltas;
+
+        // ...or quantized, in compact segments.
+        SegmentArray<std::uint64_t> packedPositions;
+        SegmentArray<std::uint32_t> packedDirections;
+        SegmentArray<PackedSpectrum> packedBsdfVals;
+
+        SegmentArray<Float> times;
+        SegmentArray<Float> bsdfPdfs;
+        SegmentArray<Float> woPdfs;
+        SegmentArray<float> scaleFactors;
+        SegmentArray<STree::LeafHandle> leaves;
+
+        SegmentArray<RadRecord> radianceRecords;
+        SegmentArray<NEERecord> neeRecords;
+
+        // Calls visitor on every array of the segment.
+        template <typename Visitor>
+        void visitArrays(Visitor& visitor) {
+            visitor(positions);
+            visitor(directions);
+            visitor(bsdfVals);
+            visitor(deltas);
+            visitor(packedPositions);
+            visitor(packedDirections);
+            visitor(packedBsdfVals);
+            visitor(times);
+            visitor(bsdfPdfs);
+            visitor(woPdfs);
+            visitor(scaleFactors);
+            visitor(leaves);
+            visitor(radianceRecords);
+            visitor(neeRecords);
+        }
 
-        // Loss gradient w.r.t. sampling fraction
-        Float mixPdf = samplingFraction * rec.bsdfPdf + (1 - samplingFraction) * rec.dTreePdf;
-        Float ratio = std::pow(rec.product / mixPdf, ratioPower);
-        Float dLoss_dSamplingFraction = -ratio / rec.woPdf * (rec.bsdfPdf - rec.dTreePdf);
+        // Entries of the appended paths until the segment is published.
+        std::vector<PathEntry> entries;
+
+        void append(const RPath& path) {
+            PathEntry entry;
+            entry.segment = this;
+            entry.firstVertex = (std::uint32_t)times.size();
+            entry.firstRadiance = (std::uint32_t)radianceRecords.size();
+            entry.firstNee = (std::uint32_t)neeRecords.size();
+            entry.numVertices = (std::uint32_t)path.path.size();
+            entry.numRadiance = (std::uint32_t)path.radiance_records.size();
+            entry.numNee = (std::uint32_t)path.nee_records.size();
+            entry.active = path.active;
+            entry.iter = path.iter;
+            entries.push_back(entry);
+
+            for (const RVertex& vertex : path.path) {
+                if (compact) {
+                    packedPositions.push_back(packPosition(vertex.o, vertex.isDelta));
+                    packedDirections.push_back(packDirection(vertex.d));
+                    packedBsdfVals.push_back(packSpectrum(vertex.bsdfVal));
+                } else {
+                    positions.push_back(vertex.o);
+                    directions.push_back(vertex.d);
+                    bsdfVals.push_back(vertex.bsdfVal);
+                    deltas.push_back(vertex.isDelta ? 1 : 0);
+                }
+                times.push_back(vertex.time);
+                bsdfPdfs.push_back(vertex.bsdfPdf);
+                woPdfs.push_back(vertex.woPdf);
+                scaleFactors.push_back(vertex.sc);
+                leaves.push_back(vertex.leaf);
+            }
 
-        // Chain rule to get loss gradient w.r.t. trainable variable
-        Float dLoss_dVariable = dLoss_dSamplingFraction * dBsdfSamplingFraction_dVariable(variable);
+            radianceRecords.append(path.radiance_records.begin(), path.radiance_records.end());
+            neeRecords.append(path.nee_records.begin(), path.nee_records.end());
+        }
 
-        // We want some regularization such that our parameter does not become too big.
-        // We use l2 regularization, resulting in the following linear gradient.
-        Float l2RegGradient = 0.01f * variable;
+        std::uint64_t packPosition(const Point& p, bool isDelta) const {
+            std::uint64_t packed = isDelta ? DELTA_BIT : 0;
+            for (int a = 0; a < 3; ++a) {
+                const Float q = math::clamp((p[a] - boundsMin[a]) * quantizationScale[a], (Float)0, (Float)POSITION_MAX);
+                packed |= std::uint64_t(q + (Float)0.5) << (a * POSITION_BITS);
+            }
+            return packed;
+        }
 
-        Float lossGradient = l2RegGradient + dLoss_dVariable;
+        Point position(std::uint32_t k) const {
+            if (!compact) {
+                return positions[k];
+            }
 
-        // ADAM GRADIENT DESCENT
-        bsdfSamplingFractionOptimizer.append(lossGradient, rec.statisticalWeight);
+            Point p;
+            for (int a = 0; a < 3; ++a) {
+                p[a] = boundsMin[a] + ((packedPositions[k] >> (a * POSITION_BITS)) & POSITION_MAX) * quantizationStep[a];
+            }
+            return p;
+        }
 
-        m_lock.unlock();
-    }
+        Vector direction(std::uint32_t k) const {
+            return compact ? unpackDirection(packedDirections[k]) : directions[k];
+        }
 
-    void dump(BlobWriter& blob, const Point& p, const Vector& size) const {
-        blob
-            << (float)p.x << (float)p.y << (float)p.z
-            << (float)size.x << (float)size.y << (float)size.z
-            << (float)sampling.mean() << (uint64_t)sampling.statisticalWeight() << (uint64_t)sampling.numNodes();
+        Spectrum bsdfVal(std::uint32_t k) const {
+            return compact ? unpackSpectrum(packedBsdfVals[k]) : bsdfVals[k];
+        }
 
-        for (size_t i = 0; i < sampling.numNodes(); ++i) {
-            const auto& node = sampling.node(i);
-            for (int j = 0; j < 4; ++j) {
-                blob << (float)node.sum(j) << (uint16_t)node.child(j);
-            }
+        bool isDelta(std::uint32_t k) const {
+            return compact ? (packedPositions[k] & DELTA_BIT) != 0 : deltas[k] != 0;
         }
-    }
 
-    std::pair<Float, Float> getMajorizingFactor(){
-        return m_rejPdfPair;
-    }
+        void shrinkToFit() {
+            ShrinkVisitor shrink;
+            visitArrays(shrink);
+        }
 
-private:
-    DTree building;
-    DTree sampling;
-    DTree previous;
-    DTree augmented;
-    DTree savedAug;
+        // Size of the arrays in a spill file.
+        size_t bytes() {
+            ByteCountVisitor count{0};
+            visitArrays(count);
+            return count.bytes;
+        }
 
-    std::uint64_t current_samples;
-    std::uint64_t req_augmented_samples;
-    double total_samples;
-    std::atomic<float> weighted_previous_samples;
-    float B;
+        // Moves the arrays to dst, which must hold bytes() bytes.
+        void spill(char* dst) {
+            spillBytes = bytes();
+            spillData = dst;
+            SpillVisitor move{dst};
+            visitArrays(move);
+        }
 
-    std::pair<Float, Float> m_rejPdfPair;
+    private:
+        struct ShrinkVisitor {
+            template <typename T>
+            void operator()(SegmentArray<T>& array) {
+                array.shrinkToFit();
+            }
+        };
 
-    AdamOptimizer bsdfSamplingFractionOptimizer{0.01f};
+        struct ByteCountVisitor {
+            size_t bytes;
 
-    float min_nzradiance;
+            template <typename T>
+            void operator()(SegmentArray<T>& array) {
+                bytes += alignSpill(array.bytes());
+            }
+        };
 
-    class SpinLock {
-    public:
-        SpinLock() {
-            m_mutex.clear(std::memory_order_release);
-        }
+        struct SpillVisitor {
+            char* dst;
 
-        SpinLock(const SpinLock& other) { m_mutex.clear(std::memory_order_release); }
-        SpinLock& operator=(const SpinLock& other) { return *this; }
+            template <typename T>
+            void operator()(SegmentArray<T>& array) {
+                const size_t bytes = array.bytes();
+                array.moveTo(dst);
+                dst += alignSpill(bytes);
+            }
+        };
+    };
 
-        void lock() {
-            while (m_mutex.test_and_set(std::memory_order_acquire)) { }
+    // A stored path. Dropping it keeps its data in the segment until the arena is cleared.
+    class PathRef {
+    public:
+        PathRef(PathEntry& entry) : m_entry(entry) {
         }
 
-        void unlock() {
-            m_mutex.clear(std::memory_order_release);
+        bool active() const {
+            return m_entry.active;
         }
-    private:
-        std::atomic_flag m_mutex;
-    } m_lock;
-};
-
-struct STreeNode {
-    STreeNode() {
-        children = {};
-        isLeaf = true;
-        axis = 0;
-        level = 0;
-    }
 
-    int childIndex(Point& p) const {
-        if (p[axis] < 0.5f) {
-            p[axis] *= 2;
-            return 0;
-        } else {
-            p[axis] = (p[axis] - 0.5f) * 2;
-            return 1;
+        void drop() {
+            m_entry.active = false;
+            m_entry.numVertices = 0;
+            m_entry.numRadiance = 0;
+            m_entry.numNee = 0;
         }
-    }
 
-    int nodeIndex(Point& p) const {
-        return children[childIndex(p)];
-    }
+        std::uint32_t size() const {
+            return m_entry.numVertices;
+        }
 
-    DTreeWrapper* dTreeWrapper(Point& p, Vector& size, std::vector<STreeNode>& nodes) {
-        SAssert(p[axis] >= 0 && p[axis] <= 1);
-        if (isLeaf) {
-            return &dTree;
-        } else {
-            size[axis] /= 2;
-            return nodes[nodeIndex(p)].dTreeWrapper(p, size, nodes);
+        RVertexRef vertex(std::uint32_t j) const {
+            Segment& s = *m_entry.segment;
+            const std::uint32_t k = m_entry.firstVertex + j;
+            return RVertexRef{
+                s.position(k),
+                s.direction(k),
+                s.times[k],
+                s.bsdfVal(k),
+                s.bsdfPdfs[k],
+                s.woPdfs[k],
+                s.isDelta(k),
+                s.scaleFactors[k],
+                s.leaves[k],
+            };
         }
-    }
 
-    const DTreeWrapper* dTreeWrapper() const {
-        return &dTree;
-    }
+        float& scaleFactor(std::uint32_t j) const {
+            return m_entry.segment->scaleFactors[m_entry.firstVertex + j];
+        }
 
-    int depth(Point& p, const std::vector<STreeNode>& nodes) const {
-        SAssert(p[axis] >= 0 && p[axis] <= 1);
-        if (isLeaf) {
-            return 1;
-        } else {
-            return 1 + nodes[nodeIndex(p)].depth(p, nodes);
+        Float& woPdf(std::uint32_t j) const {
+            return m_entry.segment->woPdfs[m_entry.firstVertex + j];
         }
-    }
 
-    int depth(const std::vector<STreeNode>& nodes) const {
-        int result = 1;
+        // The directions of all vertices, decoded into scratch if the segment is compact.
+        const Vector* directions(std::vector<Vector>& scratch) const {
+            const Segment& s = *m_entry.segment;
+            if (!s.compact) {
+                return s.directions.data() + m_entry.firstVertex;
+            }
 
-        if (!isLeaf) {
-            for (auto c : children) {
-                result = std::max(result, 1 + nodes[c].depth(nodes));
+            scratch.resize(m_entry.numVertices);
+            for (std::uint32_t j = 0; j < m_entry.numVertices; ++j) {
+                scratch[j] = unpackDirection(s.packedDirections[m_entry.firstVertex + j]);
             }
+            return scratch.data();
         }
 
-        return result;
-    }
-
-    void forEachLeaf(
-        std::function<void(const DTreeWrapper*, const Point&, const Vector&)> func,
-        Point p, Vector size, const std::vector<STreeNode>& nodes) const {
+        std::uint32_t numRadianceRecords() const {
+            return m_entry.numRadiance;
+        }
 
-        if (isLeaf) {
-            func(&dTree, p, size);
-        } else {
-            size[axis] /= 2;
-            for (int i = 0; i < 2; ++i) {
-                Point childP = p;
-                if (i == 1) {
-                    childP[axis] += size[axis];
-                }
+        const RadRecord& radianceRecord(std::uint32_t j) const {
+            return m_entry.segment->radianceRecords[m_entry.firstRadiance + j];
+        }
 
-                nodes[children[i]].forEachLeaf(func, childP, size, nodes);
-            }
+        std::uint32_t numNeeRecords() const {
+            return m_entry.numNee;
         }
-    }
 
-    Float computeOverlappingVolume(const Point& min1, const Point& max1, const Point& min2, const Point& max2) {
-        Float lengths[3];
-        for (int i = 0; i < 3; ++i) {
-            lengths[i] = std::max(std::min(max1[i], max2[i]) - std::max(min1[i], min2[i]), 0.0f);
+        const NEERecord& neeRecord(std::uint32_t j) const {
+            return m_entry.segment->neeRecords[m_entry.firstNee + j];
         }
-        return lengths[0] * lengths[1] * lengths[2];
-    }
 
-    void record(const Point& min1, const Point& max1, Point min2, Vector size2, const DTreeRecord& rec, EDirectionalFilter directionalFilter, 
-        EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, std::vector<STreeNode>& nodes, Float actualSW) {
-        Float w = computeOverlappingVolume(min1, max1, min2, min2 + size2);
-        if (w > 0) {
-            if (isLeaf) {
-                dTree.record({ rec.d, rec.radiance, rec.product, rec.woPdf, rec.bsdfPdf, rec.dTreePdf, rec.statisticalWeight * w, rec.isDelta }, 
-                    directionalFilter, bsdfSamplingFractionLoss, actualSW);
-            } else {
-                size2[axis] /= 2;
-                for (int i = 0; i < 2; ++i) {
-                    if (i & 1) {
-                        min2[axis] += size2[axis];
-                    }
+    private:
+        PathEntry& m_entry;
+    };
 
-                    nodes[children[i]].record(min1, max1, min2, size2, rec, directionalFilter, bsdfSamplingFractionLoss, nodes, actualSW);
-                }
-            }
-        }
+    // Segments are spilled once the arrays of all segments in memory take more than memoryLimit bytes.
+    RPathArena(bool compact, const AABB& bounds, size_t memoryLimit = std::numeric_limits<size_t>::max())
+        : m_compact(compact), m_bounds(bounds), m_memoryLimit(memoryLimit), m_residentBytes(0), m_spillOffset(0) {
     }
 
-    bool isLeaf;
-    DTreeWrapper dTree;
-    int axis;
-    std::array<uint32_t, 2> children;
-    int level;
-};
+    size_t size() const {
+        return m_entries.size();
+    }
 
+    std::unique_ptr<Segment> newSegment() const {
+        return std::unique_ptr<Segment>(new Segment(m_compact, m_bounds));
+    }
 
-class STree {
-public:
-    STree(const AABB& aabb) {
-        clear();
+    // Adds empty, inactive slots for the paths of the next iteration.
+    void resize(size_t size) {
+        m_entries.resize(size);
+        m_segments.resize(size);
+    }
 
-        m_aabb = aabb;
+    void clear() {
+        m_entries.clear();
+        m_entries.shrink_to_fit();
+        m_segments.clear();
+        m_segments.shrink_to_fit();
+        m_spillFiles.clear();
+        m_residentBytes = 0;
+        m_spillOffset = 0;
+    }
 
-        // Enlarge AABB to turn it into a cube. This has the effect
-        // of nicer hierarchical subdivisions.
-        Vector size = m_aabb.max - m_aabb.min;
-        Float maxSize = std::max(std::max(size.x, size.y), size.z);
-        m_aabb.max = m_aabb.min + Vector(maxSize);
+    PathRef operator[](size_t i) {
+        return PathRef(m_entries[i]);
     }
 
-    void clear() {
-        m_nodes.clear();
-        m_nodes.emplace_back();
+    /**
+        Same as operator[], but also starts reading in spilled segments a little ahead
+        of path i, for passes that go through the paths in order. Without spilled
+        segments this is a no-op.
+    */
+    PathRef fetch(size_t i) {
+        prefetch(i + PREFETCH_DISTANCE);
+        return PathRef(m_entries[i]);
     }
 
-    void subdivide(int levels){
-        for(int i = 0; i < levels; ++i){
-            subdivideAll();
+    // Lets fetch() read in every spilled segment once more, for the next pass.
+    void resetPrefetch() {
+        for (const auto& segment : m_segments) {
+            if (segment) {
+                segment->prefetched.store(false, std::memory_order_relaxed);
+            }
         }
     }
 
-    void subdivideAll() {
-        int nNodes = (int)m_nodes.size();
-        for (int i = 0; i < nNodes; ++i) {
-            if (m_nodes[i].isLeaf) {
-                subdivide(i, m_nodes);
-            }
+    size_t spilledBytes() const {
+        size_t bytes = 0;
+        for (const auto& file : m_spillFiles) {
+            bytes += file->getSize();
+        }
+        return bytes;
+    }
+
+    /**
+        Moves the paths of a segment into the slots starting at firstSlot. The slots
+        must have been reserved for the segment alone, which is what makes this safe
+        to call from several threads at once.
+    */
+    void publish(size_t firstSlot, std::unique_ptr<Segment> segment) {
+        segment->shrinkToFit();
+        std::copy(segment->entries.begin(), segment->entries.end(), m_entries.begin() + firstSlot);
+        segment->entries.clear();
+        segment->entries.shrink_to_fit();
+
+        const size_t bytes = segment->bytes();
+        if (m_residentBytes.fetch_add(bytes) + bytes > m_memoryLimit) {
+            m_residentBytes -= bytes;
+            segment->spill(reserveSpill(bytes));
         }
+
+        m_segments[firstSlot] = std::move(segment);
     }
 
-    void subdivide(int nodeIdx, std::vector<STreeNode>& nodes) {
-        // Add 2 child nodes
-        nodes.resize(nodes.size() + 2);
+private:
+    // Number of paths that spilled segments are read ahead of the passes.
+    static const size_t PREFETCH_DISTANCE = 1024;
+    // Size of a spill file, unless a single segment needs more.
+    static const size_t SPILL_FILE_SIZE = size_t(256) * 1024 * 1024;
+
+    // Hands out bytes of the current spill file, starting a new one when it is full.
+    char* reserveSpill(size_t bytes) {
+        std::lock_guard<std::mutex> lock(m_spillMutex);
+        if (m_spillFiles.empty() || m_spillOffset + bytes > m_spillFiles.back()->getSize()) {
+            m_spillFiles.push_back(MemoryMappedFile::createTemporary(std::max(SPILL_FILE_SIZE, bytes)));
+            m_spillOffset = 0;
+#if defined(__LINUX__) || defined(__OSX__)
+            madvise(m_spillFiles.back()->getData(), m_spillFiles.back()->getSize(), MADV_SEQUENTIAL);
+#endif
+        }
+
+        char* data = static_cast<char*>(m_spillFiles.back()->getData()) + m_spillOffset;
+        m_spillOffset += bytes;
+        return data;
+    }
 
-        if (nodes.size() > std::numeric_limits<uint32_t>::max()) {
-            SLog(EWarn, "DTreeWrapper hit maximum children count.");
+    // Asks the operating system to read in the spilled segment that holds path i, if there is one and
+    // it has not been asked for in this pass yet.
+    void prefetch(size_t i) const {
+#if defined(__LINUX__) || defined(__OSX__)
+        if (i >= m_entries.size()) {
             return;
         }
 
-        STreeNode& cur = nodes[nodeIdx];
-        for (int i = 0; i < 2; ++i) {
-            uint32_t idx = (uint32_t)nodes.size() - 2 + i;
-            cur.children[i] = idx;
-            nodes[idx].axis = (cur.axis + 1) % 3;
-            nodes[idx].dTree = cur.dTree;
-            nodes[idx].level = cur.level + 1;
-            nodes[idx].dTree.setStatisticalWeightBuilding(nodes[idx].dTree.statisticalWeightBuilding() / 2);
-            nodes[idx].dTree.setActualStatisticalWeightBuilding(nodes[idx].dTree.actualStatisticalWeightBuilding() / 2);
+        Segment* segment = m_entries[i].segment;
+        if (!segment || !segment->spillData || segment->prefetched.load(std::memory_order_relaxed) ||
+            segment->prefetched.exchange(true, std::memory_order_relaxed)) {
+            return;
         }
-        cur.isLeaf = false;
-        cur.dTree = {}; // Reset to an empty dtree to save memory.
+
+        static const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        const size_t begin = reinterpret_cast<size_t>(segment->spillData) & ~(pageSize - 1);
+        const size_t end = reinterpret_cast<size_t>(segment->spillData) + segment->spillBytes;
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+#endif
     }
 
-    DTreeWrapper* dTreeWrapper(Point p, Vector& size) {
-        size = m_aabb.getExtents();
-        p = Point(p - m_aabb.min);
-        p.x /= size.x;
-        p.y /= size.y;
-        p.z /= size.z;
+    bool m_compact;
+    AABB m_bounds;
 
-        return m_nodes[0].dTreeWrapper(p, size, m_nodes);
-    }
+    size_t m_memoryLimit;
+    std::atomic<size_t> m_residentBytes;
 
-    DTreeWrapper* dTreeWrapper(Point p) {
-        Vector size;
-        return dTreeWrapper(p, size);
-    }
+    std::mutex m_spillMutex;
+    std::vector<ref<MemoryMappedFile>> m_spillFiles;
+    size_t m_spillOffset;
 
-    void forEachDTreeWrapperConst(std::function<void(const DTreeWrapper*)> func) const {
-        for (auto& node : m_nodes) {
-            if (node.isLeaf) {
-                func(&node.dTree);
-            }
-        }
-    }
+    std::vector<PathEntry> m_entries;
+    // Owners of the segments, at the first slot of each.
+    std::vector<std::unique_ptr<Segment>> m_segments;
+};
 
-    void forEachDTreeWrapperConstP(std::function<void(const DTreeWrapper*, const Point&, const Vector&)> func) const {
-        m_nodes[0].forEachLeaf(func, m_aabb.min, m_aabb.max - m_aabb.min, m_nodes);
-    }
+const size_t RPathArena::SPILL_FILE_SIZE;
 
-    void forEachDTreeWrapperParallel(std::function<void(DTreeWrapper*)> func) {
-        int nDTreeWrappers = static_cast<int>(m_nodes.size());
+/**
+    Assigns every rendered block the range of RPathArena slots that its paths go to.
+    Blocks tile the image like those of BlockedImageProcess, and the paths of a pass
+    are laid out block by block in scanline order. The range of a block only depends
+    on its position and on the index of the pass it is rendered in, which every
+    GuidedRenderProcess carries. Reserving a range thus needs no synchronization,
+    and the layout of the stored paths is the same in every run.
+*/
+class PathSlotLayout {
+public:
+    PathSlotLayout(const Point2i& offset, const Vector2i& size, int blockSize, int sppPerPass, int numPasses, size_t firstSlot)
+        : m_offset(offset), m_size(size), m_blockSize(blockSize), m_sppPerPass(sppPerPass), m_numPasses(numPasses), m_firstSlot(firstSlot) {
+        m_numBlocks = Vector2i((size.x + blockSize - 1) / blockSize, (size.y + blockSize - 1) / blockSize);
+        m_pathsPerPass = size_t(size.x) * size.y * sppPerPass;
+    }
 
-#pragma omp parallel for
-        for (int i = 0; i < nDTreeWrappers; ++i) {
-            if (m_nodes[i].isLeaf) {
-                func(&m_nodes[i].dTree);
-            }
-        }
+    size_t numSlots() const {
+        return m_pathsPerPass * m_numPasses;
     }
 
-    void record(const Point& p, const Vector& dTreeVoxelSize, DTreeRecord rec, 
-        EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, Float actualSW) {
-        Float volume = 1;
-        for (int i = 0; i < 3; ++i) {
-            volume *= dTreeVoxelSize[i];
+    // Returns false if the pass lies outside of the numPasses passes that the layout was made for.
+    bool reserve(const Point2i& blockOffset, int pass, size_t& firstSlot) const {
+        if (pass < 0 || pass >= m_numPasses) {
+            return false;
         }
 
-        rec.statisticalWeight /= volume;
-        m_nodes[0].record(p - dTreeVoxelSize * 0.5f, p + dTreeVoxelSize * 0.5f, m_aabb.min, m_aabb.getExtents(), 
-            rec, directionalFilter, bsdfSamplingFractionLoss, m_nodes, actualSW);
-    }
+        const int x = (blockOffset.x - m_offset.x) / m_blockSize;
+        const int y = (blockOffset.y - m_offset.y) / m_blockSize;
 
-    void dump(BlobWriter& blob) const {
-        forEachDTreeWrapperConstP([&blob](const DTreeWrapper* dTree, const Point& p, const Vector& size) {
-            if (dTree->statisticalWeight() > 0) {
-                dTree->dump(blob, p, size);
-            }
-        });
+        const size_t rowHeight = std::min(m_blockSize, m_size.y - y * m_blockSize);
+        const size_t pixelsBefore = size_t(y) * m_blockSize * m_size.x + size_t(x) * m_blockSize * rowHeight;
+        firstSlot = m_firstSlot + pass * m_pathsPerPass + pixelsBefore * m_sppPerPass;
+        return true;
     }
 
-    bool shallSplit(const STreeNode& node, int depth, size_t samplesRequired) {
-        return m_nodes.size() < std::numeric_limits<uint32_t>::max() - 1 && node.dTree.actualStatisticalWeightBuilding() > samplesRequired;
+private:
+    Point2i m_offset;
+    Vector2i m_size;
+    Vector2i m_numBlocks;
+    int m_blockSize;
+    int m_sppPerPass;
+    int m_numPasses;
+    size_t m_firstSlot;
+    size_t m_pathsPerPass;
+};
+
+class GuidedPathTracer;
+
+/**
+    Same as the work processor of BlockedRenderProcess, but tells the integrator
+    which pass the blocks belong to.
+*/
+class GuidedBlockRenderer : public WorkProcessor {
+public:
+    GuidedBlockRenderer(Bitmap::EPixelFormat pixelFormat, int channelCount, int blockSize,
+        int borderSize, bool warnInvalid, int pass) : m_pixelFormat(pixelFormat),
+        m_channelCount(channelCount), m_blockSize(blockSize),
+        m_borderSize(borderSize), m_warnInvalid(warnInvalid), m_pass(pass) {
     }
 
-    void refine(size_t sTreeThreshold, int maxMB, bool staticSTree) {
-        if (maxMB >= 0) {
-            size_t approxMemoryFootprint = 0;
-            for (const auto& node : m_nodes) {
-                approxMemoryFootprint += node.dTreeWrapper()->approxMemoryFootprint();
-            }
+    GuidedBlockRenderer(Stream *stream, InstanceManager *manager) {
+        m_pixelFormat = (Bitmap::EPixelFormat) stream->readInt();
+        m_channelCount = stream->readInt();
+        m_blockSize = stream->readInt();
+        m_borderSize = stream->readInt();
+        m_warnInvalid = stream->readBool();
+        m_pass = stream->readInt();
+    }
 
-            if (approxMemoryFootprint / 1000000 >= (size_t)maxMB) {
-                return;
-            }
-        }
-        
-        struct StackNode {
-            size_t index;
-            int depth;
-        };
+    ref<WorkUnit> createWorkUnit() const {
+        return new RectangularWorkUnit();
+    }
 
-        std::stack<StackNode> nodeIndices;
-        nodeIndices.push({0,  1});
-        while (!nodeIndices.empty()) {
-            StackNode sNode = nodeIndices.top();
-            nodeIndices.pop();
+    ref<WorkResult> createWorkResult() const {
+        return new ImageBlock(m_pixelFormat,
+            Vector2i(m_blockSize),
+            m_sensor->getFilm()->getReconstructionFilter(),
+            m_channelCount, m_warnInvalid);
+    }
 
-            // Subdivide if needed and leaf
-            if (m_nodes[sNode.index].isLeaf) {
-                if (shallSplit(m_nodes[sNode.index], sNode.depth, sTreeThreshold)) {
-                    if(!staticSTree){
-                        subdivide((int)sNode.index, m_nodes);
-                    }
-                }
-            }
+    void prepare() {
+        Scene *scene = static_cast<Scene *>(getResource("scene"));
+        m_scene = new Scene(scene);
+        m_sampler = static_cast<Sampler *>(getResource("sampler"));
+        m_sensor = static_cast<Sensor *>(getResource("sensor"));
+        m_integrator = static_cast<SamplingIntegrator *>(getResource("integrator"));
+        m_scene->removeSensor(scene->getSensor());
+        m_scene->addSensor(m_sensor);
+        m_scene->setSensor(m_sensor);
+        m_scene->setSampler(m_sampler);
+        m_scene->setIntegrator(m_integrator);
+        m_integrator->wakeup(m_scene, m_resources);
+        m_scene->wakeup(m_scene, m_resources);
+        m_scene->initializeBidirectional();
+    }
 
-            // Add children to stack if we're not
-            if (!m_nodes[sNode.index].isLeaf) {
-                const STreeNode& node = m_nodes[sNode.index];
-                for (int i = 0; i < 2; ++i) {
-                    nodeIndices.push({node.children[i], sNode.depth + 1});
-                }
-            }
-        }
+    void process(const WorkUnit *workUnit, WorkResult *workResult,
+        const bool &stop);
 
-        // Uncomment once memory becomes an issue.
-        //m_nodes.shrink_to_fit();
+    void serialize(Stream *stream, InstanceManager *manager) const {
+        stream->writeInt(m_pixelFormat);
+        stream->writeInt(m_channelCount);
+        stream->writeInt(m_blockSize);
+        stream->writeInt(m_borderSize);
+        stream->writeBool(m_warnInvalid);
+        stream->writeInt(m_pass);
     }
 
-    const AABB& aabb() const {
-        return m_aabb;
+    ref<WorkProcessor> clone() const {
+        return new GuidedBlockRenderer(m_pixelFormat, m_channelCount,
+            m_blockSize, m_borderSize, m_warnInvalid, m_pass);
     }
 
+    MTS_DECLARE_CLASS()
+protected:
+    virtual ~GuidedBlockRenderer() {}
 private:
-    std::vector<STreeNode> m_nodes;
-    AABB m_aabb;
-};
-
-struct RVertex{
-    Point o;
-    Vector d;
-    Float time;
-    Spectrum bsdfVal;
-    Float bsdfPdf, woPdf;
-    bool isDelta;
-    float sc;
+    ref<Scene> m_scene;
+    ref<Sensor> m_sensor;
+    ref<Sampler> m_sampler;
+    ref<SamplingIntegrator> m_integrator;
+    Bitmap::EPixelFormat m_pixelFormat;
+    int m_channelCount;
+    int m_blockSize;
+    int m_borderSize;
+    bool m_warnInvalid;
+    int m_pass;
+    HilbertCurve2D<uint8_t> m_hilbertCurve;
 };
 
-struct RadRecord{
-    int pos;
-    Spectrum L;
-    float pdf;
-};
+/// Renders one pass of the GuidedPathTracer, whose index the blocks are rendered with.
+class GuidedRenderProcess : public BlockedRenderProcess {
+public:
+    GuidedRenderProcess(const RenderJob *parent, RenderQueue *queue, int blockSize, int pass)
+        : BlockedRenderProcess(parent, queue, blockSize), m_pass(pass) {
+    }
 
-struct NEERecord{
-    int pos;
-    Spectrum L;
-    float pdf;
-    Vector wo;
-    Spectrum bsdfVal;
-    Float bsdfPdf;
-};
+    ref<WorkProcessor> createWorkProcessor() const {
+        return new GuidedBlockRenderer(m_pixelFormat, m_channelCount,
+            m_blockSize, m_borderSize, m_warnInvalid, m_pass);
+    }
 
-struct RPath{
-    std::vector<RVertex> path;
-    std::vector<RadRecord> radiance_records;
-    std::vector<NEERecord> nee_records;
-    Point2 sample_pos;
-    bool active;
-    std::int8_t iter;
+    MTS_DECLARE_CLASS()
+protected:
+    virtual ~GuidedRenderProcess() {}
+private:
+    int m_pass;
 };
 
 static StatsCounter avgPathLength("Guided path tracer", "Average path length", EAverage);
 
-size_t curr_buffer_pos = 0;
-
 class GuidedPathTracer : public MonteCarloIntegrator {
 public:
     GuidedPathTracer(const Properties &props) : MonteCarloIntegrator(props) {
@@ -1685,6 +4308,7 @@ public:
 
         m_sdTreeMaxMemory = props.getInteger("sdTreeMaxMemory", -1);
         m_sTreeThreshold = props.getInteger("sTreeThreshold", 12000);
+        m_sTreeDivergenceThreshold = props.getFloat("sTreeDivergenceThreshold", 0.0f);
         m_dTreeThreshold = props.getFloat("dTreeThreshold", 0.01f);
         m_bsdfSamplingFraction = props.getFloat("bsdfSamplingFraction", 0.5f);
         m_sppPerPass = props.getInteger("sppPerPass", 4);
@@ -1715,17 +4339,24 @@ public:
         m_lastStrategyIteration = props.getInteger("lastStrategyiteration", 100);
         m_renderIterations = props.getBoolean("renderIterations", false);
         m_staticSTree = props.getBoolean("staticSTree", false);
+        m_threadLocalSplatting = props.getBoolean("threadLocalSplatting", false);
+        m_numaReplication = props.getBoolean("numaReplication", false);
+        m_recordBatchSize = props.getInteger("recordBatchSize", 0);
+        m_aliasSampling = props.getBoolean("aliasSampling", false);
+        m_staticSTreeDepth = props.getInteger("staticSTreeDepth", 16);
+        m_compactPathStorage = props.getBoolean("compactPathStorage", false);
+        m_samplePathMaxMemory = props.getInteger("samplePathMaxMemory", -1);
 
         m_sampleless_aug = false;
     }
 
-    ref<BlockedRenderProcess> renderPass(Scene *scene,
+    ref<BlockedRenderProcess> renderPass(int pass, Scene *scene,
         RenderQueue *queue, const RenderJob *job,
         int sceneResID, int sensorResID, int samplerResID, int integratorResID) {
 
         /* This is a sampling-based integrator - parallelize */
-        ref<BlockedRenderProcess> proc = new BlockedRenderProcess(job,
-            queue, scene->getBlockSize());
+        ref<BlockedRenderProcess> proc = new GuidedRenderProcess(job,
+            queue, scene->getBlockSize(), pass);
 
         proc->disableProgress();
 
@@ -1744,23 +4375,19 @@ public:
         Log(EInfo, "Resetting distributions for sampling.");
 
         m_sdTree->refine((size_t)(std::sqrt(std::pow(2, m_iter) * m_sppPerPass / 4) * m_sTreeThreshold), m_sdTreeMaxMemory, m_staticSTree);
-        m_sdTree->forEachDTreeWrapperParallel([this, &augment](DTreeWrapper* dTree) { dTree->reset(20, m_dTreeThreshold, augment); });
+        m_sdTree->resetDTrees(20, m_dTreeThreshold, augment, m_sdTreeMaxMemory);
     }
 
     void updateRequiredSamples(ref<Sampler> sampler){
         //parallelize and make thread safe
-        #pragma omp parallel for
-        for(size_t i = 0; i < m_samplePaths->size(); ++i){
-            if(!(*m_samplePaths)[i].active){
-                continue;
-            }
-
-            for(size_t j = 0; j < (*m_samplePaths)[i].path.size(); ++j){
+        forEachStoredPath(m_samplePaths->size(), sampler, [&](RPathArena::PathRef curr_path, ReuseScratch&, DTreeRecordQueue*){
+            for(std::uint32_t j = 0; j < curr_path.size(); ++j){
+                RVertexRef vertex = curr_path.vertex(j);
                 Vector dTreeVoxelSize;
-                DTreeWrapper* dTree = m_sdTree->dTreeWrapper((*m_samplePaths)[i].path[j].o, dTreeVoxelSize);
-                dTree->addWeightedSampleCount((*m_samplePaths)[i].path[j].sc);
+                DTreeWrapper* dTree = m_sdTree->dTreeWrapper(vertex.o, dTreeVoxelSize, vertex.leaf);
+                dTree->addWeightedSampleCount(vertex.sc);
             }
-        }
+        });
 
         m_sdTree->forEachDTreeWrapperParallel([this, &sampler](DTreeWrapper* dTree) { 
             dTree->computeRequiredSamples(sampler);
@@ -1770,11 +4397,20 @@ public:
     void buildSDTree(ref<Sampler> sampler, bool reuseSamples) {
         Log(EInfo, "Building distributions for sampling.");
 
+        m_sdTree->flushSplatBuffers();
+
         // Build distributions
         bool raugment = this->m_rejectAugment || this->m_reweightAugment;
         m_sdTree->forEachDTreeWrapperParallel([&sampler, this, raugment, reuseSamples](DTreeWrapper* dTree) { 
             dTree->build(this->m_augment || m_sampleless_aug, raugment, this->m_isBuilt, sampler, reuseSamples, m_sampleless_aug); });
 
+        if (m_numaReplication) {
+            const int nNodes = m_sdTree->replicateSamplingTrees();
+            if (nNodes > 0) {
+                Log(EInfo, "Replicated the sampling distributions on %i NUMA nodes.", nNodes);
+            }
+        }
+
         // Gather statistics
         int maxDepth = 0;
         int minDepth = std::numeric_limits<int>::max();
@@ -1854,6 +4490,7 @@ public:
         auto cameraMatrix = sensor->getWorldTransform()->eval(0).getMatrix();
 
         BlobWriter blob(path.string());
+        blob << SDT_MAGIC << SDT_VERSION;
 
         for (int i = 0; i < 4; ++i) {
             for (int j = 0; j < 4; ++j) {
@@ -1880,8 +4517,9 @@ public:
 
         auto start = std::chrono::steady_clock::now();
 
+        // Passes are numbered within the iteration, so that extra final passes do not get the slots of earlier ones.
         for (int i = 0; i < numPasses; ++i) {
-            ref<BlockedRenderProcess> process = renderPass(scene, queue, job, sceneResID, sensorResID, samplerResID, integratorResID);
+            ref<BlockedRenderProcess> process = renderPass(m_passesRenderedThisIter + i, scene, queue, job, sceneResID, sensorResID, samplerResID, integratorResID);
             m_renderProcesses.push_back(process);
             totalBlocks += process->totalBlocks();
         }
@@ -1944,6 +4582,8 @@ public:
 
         m_renderProcesses.clear();
 
+        m_sdTree->flushSplatBuffers();
+
         variance = 0;
         Bitmap* squaredImage = m_squaredImage->getBitmap();
         Bitmap* image = m_image->getBitmap();
@@ -2016,8 +4656,10 @@ public:
             radiance += r;
         }
 
+        // If a record queue is given, records that target a single D-tree are queued instead of being recorded right away.
         void commit(STree& sdTree, Float statisticalWeight, Float actualSW, ESpatialFilter spatialFilter, 
-            EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, Sampler* sampler) {
+            EDirectionalFilter directionalFilter, EBsdfSamplingFractionLoss bsdfSamplingFractionLoss, Sampler* sampler,
+            DTreeRecordQueue* recordQueue = nullptr) {
             
             if (!(woPdf > 0) || !radiance.isValid() || !bsdfVal.isValid()) {
                 return;
@@ -2029,10 +4671,14 @@ public:
             if (throughput[2] * woPdf > Epsilon) localRadiance[2] = radiance[2] / throughput[2];
             Spectrum product = localRadiance * bsdfVal;
 
-            DTreeRecord rec{ ray.d, localRadiance.average(), product.average(), woPdf, bsdfPdf, dTreePdf, statisticalWeight, isDelta };
+            DTreeRecord rec{ ray.d, localRadiance.average(), product.average(), woPdf, bsdfPdf, dTreePdf, statisticalWeight, isDelta, ray.o };
             switch (spatialFilter) {
                 case ESpatialFilter::ENearest:
-                    dTree->record(rec, directionalFilter, bsdfSamplingFractionLoss, actualSW);
+                    if (recordQueue) {
+                        recordQueue->push(dTree, rec, actualSW);
+                    } else {
+                        dTree->record(rec, directionalFilter, bsdfSamplingFractionLoss, actualSW, sdTree.splatBuffer());
+                    }
                     break;
                 case ESpatialFilter::EStochasticBox:
                     {
@@ -2048,8 +4694,11 @@ public:
                         Point origin = sdTree.aabb().clip(ray.o + offset);
 
                         splatDTree = sdTree.dTreeWrapper(origin);
-                        if (splatDTree) {
-                            splatDTree->record(rec, directionalFilter, bsdfSamplingFractionLoss, actualSW);
+                        rec.p = origin;
+                        if (splatDTree && recordQueue) {
+                            recordQueue->push(splatDTree, rec, actualSW);
+                        } else if (splatDTree) {
+                            splatDTree->record(rec, directionalFilter, bsdfSamplingFractionLoss, actualSW, sdTree.splatBuffer());
                         }
                         break;
                     }
@@ -2060,22 +4709,22 @@ public:
         }
     };
 
-    void computeNee(RPath& sample_path, std::vector<Vertex>& vertices, ref<Sampler> sampler, bool fixLevel = false){
-        for(std::uint32_t j = 0; j < sample_path.nee_records.size(); ++j){
-            int pos = sample_path.nee_records[j].pos;
+    void computeNee(const RPathArena::PathRef& sample_path, std::vector<Vertex>& vertices, ref<Sampler> sampler, DTreeRecordQueue* recordQueue = nullptr, bool fixLevel = false){
+        for(std::uint32_t j = 0; j < sample_path.numNeeRecords(); ++j){
+            int pos = sample_path.neeRecord(j).pos;
             if(pos >= int(vertices.size())){
                 continue;
             }
 
-            Spectrum L = sample_path.nee_records[j].L;
-            Float pdf = sample_path.nee_records[j].pdf;
-            L *= sample_path.nee_records[j].bsdfVal;
+            Spectrum L = sample_path.neeRecord(j).L;
+            Float pdf = sample_path.neeRecord(j).pdf;
+            L *= sample_path.neeRecord(j).bsdfVal;
             DTreeWrapper* dTree = vertices[pos].dTree;
 
             int curr_level = 0;
-            Float dtreePdf = dTree->pdf(sample_path.nee_records[j].wo, -1, curr_level);
+            Float dtreePdf = dTree->pdf(sample_path.neeRecord(j).wo, -1, curr_level);
             Float bsf = dTree->bsdfSamplingFraction();
-            Float woPdf = bsf * sample_path.nee_records[j].bsdfPdf + (1 - bsf) * dtreePdf;
+            Float woPdf = bsf * sample_path.neeRecord(j).bsdfPdf + (1 - bsf) * dtreePdf;
 
             L *= miWeight(pdf, woPdf);
 
@@ -2095,36 +4744,36 @@ public:
                 Vertex v = Vertex{ 
                     dTree,
                     vertices[pos].dTreeVoxelSize,
-                    Ray(vertices[pos].ray.o, sample_path.nee_records[j].wo, 0),
-                    prevThroughput * sample_path.nee_records[j].bsdfVal / pdf,
-                    sample_path.nee_records[j].bsdfVal,
+                    Ray(vertices[pos].ray.o, sample_path.neeRecord(j).wo, 0),
+                    prevThroughput * sample_path.neeRecord(j).bsdfVal / pdf,
+                    sample_path.neeRecord(j).bsdfVal,
                     L,
                     pdf,
-                    sample_path.nee_records[j].bsdfPdf,
+                    sample_path.neeRecord(j).bsdfPdf,
                     dtreePdf,
                     false
                 };
 
-                v.commit(*m_sdTree, sample_path.path[pos].sc * 0.5f, 0.5f, m_spatialFilter, m_directionalFilter, 
-                    m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler);
+                v.commit(*m_sdTree, sample_path.scaleFactor(pos) * 0.5f, 0.5f, m_spatialFilter, m_directionalFilter, 
+                    m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler, recordQueue);
             }
         }
     }
 
-    void computeRadiance(RPath& sample_path, std::vector<Vertex>& vertices, ref<Sampler> sampler){
-        for(std::uint32_t j = 0; j < sample_path.radiance_records.size(); ++j){
-            int pos = sample_path.radiance_records[j].pos;
+    void computeRadiance(const RPathArena::PathRef& sample_path, std::vector<Vertex>& vertices, ref<Sampler> sampler){
+        for(std::uint32_t j = 0; j < sample_path.numRadianceRecords(); ++j){
+            int pos = sample_path.radianceRecord(j).pos;
 
             if(pos >= int(vertices.size())){
                 continue;
             }
 
-            Spectrum L = sample_path.radiance_records[j].L;
+            Spectrum L = sample_path.radianceRecord(j).L;
 
             if(pos >= 0){
                 L *= vertices[pos].throughput;
 
-                Float weight = miWeight(sample_path.path[pos].woPdf, sample_path.radiance_records[j].pdf);
+                Float weight = miWeight(sample_path.woPdf(pos), sample_path.radianceRecord(j).pdf);
                 L *= weight;
 
                 if(!L.isValid()){
@@ -2138,20 +4787,88 @@ public:
         }
     }
 
-    float computePdf(const RVertex& vertex, DTreeWrapper*& dTree, Vector& dTreeVoxelSize, float& dTreePdf){
-        dTree = m_sdTree->dTreeWrapper(vertex.o, dTreeVoxelSize);
+    // Maps the directions of all vertices of a path to the D-trees' canonical space in one batch.
+    static void computeCanonicals(const RPathArena::PathRef& path, std::vector<Vector>& scratch, std::vector<Point2>& canonicals){
+        canonicals.resize(path.size());
+        DTreeWrapper::dirToCanonical(path.directions(scratch), canonicals.data(), path.size());
+    }
+
+    float computePdf(const RVertexRef& vertex, const Point2& canonical, DTreeWrapper*& dTree, Vector& dTreeVoxelSize, float& dTreePdf){
+        dTree = m_sdTree->dTreeWrapper(vertex.o, dTreeVoxelSize, vertex.leaf);
         int curr_level = 0;
-        dTreePdf = dTree->pdf(vertex.d, -1, curr_level);
+        dTreePdf = dTree->pdf(canonical, -1, curr_level);
 
         Float bsf = dTree->bsdfSamplingFraction();
 
         return bsf * vertex.bsdfPdf + (1 - bsf) * dTreePdf;
     }
 
+    // Space that a thread reuses for all the stored paths it processes in a pass.
+    struct ReuseScratch {
+        std::vector<Vertex> vertices;
+        std::vector<Vector> directions;
+        std::vector<Point2> canonicals;
+        std::vector<float> prevVertSCs;
+        std::vector<float> prevVertWOs;
+        DTreeRecordQueue recordQueue;
+        ref<Sampler> sampler;
+    };
+
+    /**
+        Calls processPath on every active path among the first end stored ones.
+        The active paths are gathered up front, so that threads only get paths
+        with actual work, and handed out in chunks of neighboring paths, which
+        balances the wildly varying path lengths while still going through the
+        arena in order. Records that processPath commits through the given queue
+        (nullptr if recordBatchSize is 0) are grouped by D-tree per thread.
+        Every thread draws its random numbers from its own clone of sampler,
+        which processPath finds in the scratch space.
+    */
+    template <typename ProcessPath>
+    void forEachStoredPath(size_t end, ref<Sampler> sampler, const ProcessPath& processPath) {
+        m_activePaths.clear();
+        for (size_t i = 0; i < end; ++i) {
+            if ((*m_samplePaths)[i].active()) {
+                m_activePaths.push_back((std::uint32_t)i);
+            }
+        }
+
+        m_samplePaths->resetPrefetch();
+
+        const EBsdfSamplingFractionLoss bsdfSamplingFractionLoss = m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone;
+        const int numActivePaths = (int)m_activePaths.size();
+
+        #pragma omp parallel
+        {
+            // Picks the local copies of the sampling distributions, if there are any.
+            NumaTopology::updateCurrentNode();
+
+            ReuseScratch scratch;
+            // Cloning draws a seed from the shared sampler.
+            #pragma omp critical
+            scratch.sampler = sampler->clone();
+
+            DTreeRecordQueue* recordQueue = m_recordBatchSize > 0 ? &scratch.recordQueue : nullptr;
+
+            #pragma omp for schedule(dynamic, 64)
+            for (int k = 0; k < numActivePaths; ++k) {
+                processPath(m_samplePaths->fetch(m_activePaths[k]), scratch, recordQueue);
+
+                if (recordQueue && recordQueue->size() >= (size_t)m_recordBatchSize) {
+                    recordQueue->commit(*m_sdTree, m_directionalFilter, bsdfSamplingFractionLoss);
+                }
+            }
+
+            if (recordQueue) {
+                recordQueue->commit(*m_sdTree, m_directionalFilter, bsdfSamplingFractionLoss);
+            }
+        }
+    }
+
     void checkActivePerc(){
         std::uint32_t active = 0;
         for(std::uint32_t i = 0; i < m_samplePaths->size(); ++i){
-            if((*m_samplePaths)[i].active){
+            if((*m_samplePaths)[i].active()){
                 active++;
             }
         }
@@ -2162,25 +4879,23 @@ public:
     }
 
     void rejectCurrentPaths(ref<Sampler> sampler){
-        #pragma omp parallel for
-        for(std::uint32_t i = 0; i < m_samplePaths->size(); ++i){
-            RPath& curr_path = (*m_samplePaths)[i];
-            if(!curr_path.active){
-                continue;
-            }
-
-            std::vector<Vertex> vertices;
+        forEachStoredPath(m_samplePaths->size(), sampler, [&](RPathArena::PathRef curr_path, ReuseScratch& scratch, DTreeRecordQueue* recordQueue){
+            std::vector<Vertex>& vertices = scratch.vertices;
+            vertices.clear();
             Spectrum throughput(1.0f);
 
+            std::vector<Point2>& canonicals = scratch.canonicals;
+            computeCanonicals(curr_path, scratch.directions, canonicals);
+
             //first try reject path
             bool terminated = false;
-            for(std::uint32_t j = 0; j < curr_path.path.size(); ++j){
-                RVertex& curr_vert = curr_path.path[j];
+            for(std::uint32_t j = 0; j < curr_path.size(); ++j){
+                RVertexRef curr_vert = curr_path.vertex(j);
                 Vector dTreeVoxelSize;
                 DTreeWrapper* dTree;
                 float dTreePdf;
 
-                Float newWoPdf = computePdf(curr_vert, dTree, dTreeVoxelSize, dTreePdf);
+                Float newWoPdf = computePdf(curr_vert, canonicals[j], dTree, dTreeVoxelSize, dTreePdf);
 
                 //this can technically be cached per d-tree, but computing it here can maybe allow for tighter bounds
                 Float bsf = dTree->bsdfSamplingFraction();
@@ -2194,7 +4909,7 @@ public:
                 curr_vert.woPdf = newWoPdf;
 
                 //rejected
-                if(sampler->next1D() > acceptProb){
+                if(scratch.sampler->next1D() > acceptProb){
                     terminated = true;
                     break;
                 }
@@ -2225,56 +4940,51 @@ public:
             }
 
             if(!terminated){
-                computeRadiance(curr_path, vertices, sampler);
+                computeRadiance(curr_path, vertices, scratch.sampler);
 
                 if(m_doNee){
-                    computeNee(curr_path, vertices, sampler);
+                    computeNee(curr_path, vertices, scratch.sampler, recordQueue);
                 }
 
                 float sw = m_nee == EKickstart && m_doNee ? 0.5f : 1.0f;
 
                 for (std::uint32_t j = 0; j < vertices.size(); ++j) {
                     vertices[j].commit(*m_sdTree, sw, sw,
-                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler);
+                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, scratch.sampler, recordQueue);
                 }
             }
             else{
-                curr_path.active = false;
-                curr_path.path.clear();
-                curr_path.nee_records.clear();
-                curr_path.radiance_records.clear();
+                curr_path.drop();
             }       
-        }
+        });
 
         checkActivePerc();
     }
 
     void rejectReweightHybrid(ref<Sampler> sampler){
-        #pragma omp parallel for
-        for(std::uint32_t i = 0; i < m_samplePaths->size(); ++i){
-            RPath& curr_path = (*m_samplePaths)[i];
-            if(!curr_path.active){
-                continue;
-            }
-
+        forEachStoredPath(m_samplePaths->size(), sampler, [&](RPathArena::PathRef curr_path, ReuseScratch& scratch, DTreeRecordQueue* recordQueue){
             Spectrum throughput(1.0f);
 
-            std::vector<Vertex> vertices;
+            std::vector<Vertex>& vertices = scratch.vertices;
+            vertices.clear();
+
+            std::vector<Point2>& canonicals = scratch.canonicals;
+            computeCanonicals(curr_path, scratch.directions, canonicals);
 
             //first try reject path
             bool terminated = false;
-            for(std::uint32_t j = 0; j < curr_path.path.size(); ++j){
-                RVertex& curr_vertex = curr_path.path[j];
+            for(std::uint32_t j = 0; j < curr_path.size(); ++j){
+                RVertexRef curr_vertex = curr_path.vertex(j);
                 Vector dTreeVoxelSize;
                 DTreeWrapper* dTree;
                 float dTreePdf;
 
-                Float newWoPdf = computePdf(curr_vertex, dTree, dTreeVoxelSize, dTreePdf);
+                Float newWoPdf = computePdf(curr_vertex, canonicals[j], dTree, dTreeVoxelSize, dTreePdf);
                 Float acceptProb = newWoPdf / curr_vertex.woPdf;
                 Float oldWo = curr_vertex.woPdf;
                 curr_vertex.woPdf = newWoPdf;
 
-                if(sampler->next1D() > acceptProb){
+                if(scratch.sampler->next1D() > acceptProb){
                     terminated = true;
                     break;
                 }
@@ -2307,14 +5017,14 @@ public:
             }
 
             if(!terminated){
-                computeRadiance(curr_path, vertices, sampler);
+                computeRadiance(curr_path, vertices, scratch.sampler);
 
                 if(m_doNee){
-                    computeNee(curr_path, vertices, sampler);
+                    computeNee(curr_path, vertices, scratch.sampler, recordQueue);
                 }
 
                 for (std::uint32_t j = 0; j < vertices.size(); ++j) {
-                    Float statweight = curr_path.path[j].sc;
+                    Float statweight = curr_path.scaleFactor(j);
                     Float rsw = 1.f;
                     if(m_doNee && m_nee == EKickstart){
                         statweight *= 0.5f;
@@ -2322,16 +5032,13 @@ public:
                     }
 
                     vertices[j].commit(*m_sdTree, statweight, rsw,
-                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler);
+                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, scratch.sampler, recordQueue);
                 }
             }
             else{
-                curr_path.active = false;
-                curr_path.path.clear();
-                curr_path.nee_records.clear();
-                curr_path.radiance_records.clear();
+                curr_path.drop();
             }
-        }
+        });
 
         checkActivePerc();
     }
@@ -2339,27 +5046,27 @@ public:
     void reweightAugmentHybrid(ref<Sampler> sampler){
         bool noNewPaths = m_augmentedStartPos == m_samplePaths->size();
 
-        #pragma omp parallel for
-        for(std::uint32_t i = 0; i < m_samplePaths->size(); ++i){
-            RPath& curr_path = (*m_samplePaths)[i];
-            if(!curr_path.active){
-                continue;
-            }
-
-            std::vector<Vertex> vertices;
-            std::vector<float> prevVertSCs(curr_path.path.size());
-            std::vector<float> prevVertWOs(curr_path.path.size());
+        forEachStoredPath(m_samplePaths->size(), sampler, [&](RPathArena::PathRef curr_path, ReuseScratch& scratch, DTreeRecordQueue* recordQueue){
+            std::vector<Vertex>& vertices = scratch.vertices;
+            vertices.clear();
+            std::vector<float>& prevVertSCs = scratch.prevVertSCs;
+            prevVertSCs.resize(curr_path.size());
+            std::vector<float>& prevVertWOs = scratch.prevVertWOs;
+            prevVertWOs.resize(curr_path.size());
 
             Spectrum throughput(1.0f);
             bool terminated = false;
 
-            for(std::uint32_t j = 0; j < curr_path.path.size(); ++j){
-                RVertex& curr_vertex = curr_path.path[j];
+            std::vector<Point2>& canonicals = scratch.canonicals;
+            computeCanonicals(curr_path, scratch.directions, canonicals);
+
+            for(std::uint32_t j = 0; j < curr_path.size(); ++j){
+                RVertexRef curr_vertex = curr_path.vertex(j);
                 Vector dTreeVoxelSize;
                 DTreeWrapper* dTree;
                 float dTreePdf;
 
-                Float nwo = computePdf(curr_vertex, dTree, dTreeVoxelSize, dTreePdf);
+                Float nwo = computePdf(curr_vertex, canonicals[j], dTree, dTreeVoxelSize, dTreePdf);
 
                 if(noNewPaths){
                     prevVertSCs[j] = curr_vertex.sc;
@@ -2399,20 +5106,17 @@ public:
             }
 
             if(terminated){
-                curr_path.active = false;
-                curr_path.path.clear();
-                curr_path.nee_records.clear();
-                curr_path.radiance_records.clear();
+                curr_path.drop();
             }
             else{
-                computeRadiance(curr_path, vertices, sampler);
+                computeRadiance(curr_path, vertices, scratch.sampler);
 
                 if(m_doNee){
-                    computeNee(curr_path, vertices, sampler);
+                    computeNee(curr_path, vertices, scratch.sampler, recordQueue);
                 }
 
                 for (std::uint32_t j = 0; j < vertices.size(); ++j) {
-                    Float statweight = curr_path.path[j].sc;
+                    Float statweight = curr_path.scaleFactor(j);
                     Float rsw = 1.f;
                     if(m_doNee && m_nee == EKickstart){
                         statweight *= 0.5f;
@@ -2420,39 +5124,35 @@ public:
                     }
                     
                     vertices[j].commit(*m_sdTree, statweight, rsw,
-                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler);
+                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, scratch.sampler, recordQueue);
                 
                     if(noNewPaths){
-                        curr_path.path[j].sc = prevVertSCs[j];
-                        curr_path.path[j].woPdf = prevVertWOs[j];
+                        curr_path.scaleFactor(j) = prevVertSCs[j];
+                        curr_path.woPdf(j) = prevVertWOs[j];
                     } 
                 }
             }
-        }
+        });
     }
 
     void performAugmentedSamples(ref<Sampler> sampler, bool finalIter){
         bool noNewPaths = m_augmentedStartPos == m_samplePaths->size();
-        #pragma omp parallel for
-        for(std::uint32_t i = 0; i < m_augmentedStartPos; ++i){
-            RPath& curr_path = (*m_samplePaths)[i];
-            if(!curr_path.active){
-                continue;
-            }
-
+        forEachStoredPath(m_augmentedStartPos, sampler, [&](RPathArena::PathRef curr_path, ReuseScratch& scratch, DTreeRecordQueue* recordQueue){
             Spectrum throughput(1.0f);
 
-            std::vector<Vertex> vertices;
-            std::vector<float> prevVertSCs(curr_path.path.size());
+            std::vector<Vertex>& vertices = scratch.vertices;
+            vertices.clear();
+            std::vector<float>& prevVertSCs = scratch.prevVertSCs;
+            prevVertSCs.resize(curr_path.size());
             
             bool terminated = false;
 
-            for(std::uint32_t j = 0; j < curr_path.path.size(); ++j){
-                RVertex& curr_vert = curr_path.path[j];
+            for(std::uint32_t j = 0; j < curr_path.size(); ++j){
+                RVertexRef curr_vert = curr_path.vertex(j);
                 Vector dTreeVoxelSize;
                 DTreeWrapper* dTree;
                 
-                dTree = m_sdTree->dTreeWrapper(curr_vert.o, dTreeVoxelSize);
+                dTree = m_sdTree->dTreeWrapper(curr_vert.o, dTreeVoxelSize, curr_vert.leaf);
                 float bsf = dTree->bsdfSamplingFraction();
                 float dTreePdf = (curr_vert.woPdf - bsf * curr_vert.bsdfPdf) / (1.f - bsf);
 
@@ -2490,20 +5190,17 @@ public:
 
 
             if(terminated){
-                curr_path.active = false;
-                curr_path.path.clear();
-                curr_path.nee_records.clear();
-                curr_path.radiance_records.clear();
+                curr_path.drop();
             }
             else{
-                computeRadiance(curr_path, vertices, sampler);
+                computeRadiance(curr_path, vertices, scratch.sampler);
 
                 if(m_doNee){
-                    computeNee(curr_path, vertices, sampler);
+                    computeNee(curr_path, vertices, scratch.sampler, recordQueue);
                 }
 
                 for (std::uint32_t j = 0; j < vertices.size(); ++j) {
-                    Float statweight = curr_path.path[j].sc;
+                    Float statweight = curr_path.scaleFactor(j);
                     Float rsw = 1.f;
                     if(m_doNee && m_nee == EKickstart){
                         statweight *= 0.5f;
@@ -2511,39 +5208,39 @@ public:
                     }
 
                     vertices[j].commit(*m_sdTree, statweight, rsw,
-                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler);
+                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, scratch.sampler, recordQueue);
                 
                     if(noNewPaths){
-                        curr_path.path[j].sc = prevVertSCs[j];
+                        curr_path.scaleFactor(j) = prevVertSCs[j];
                     }   
                 }
             }
-        }
+        });
     }
 
     void rejectAugmentHybrid(ref<Sampler> sampler){
         bool noNewPaths = m_augmentedStartPos == m_samplePaths->size();
-        #pragma omp parallel for
-        for(std::uint32_t i = 0; i < m_augmentedStartPos; ++i){
-            RPath& curr_path = (*m_samplePaths)[i];
-            if(!curr_path.active){
-                continue;
-            }
-
+        forEachStoredPath(m_augmentedStartPos, sampler, [&](RPathArena::PathRef curr_path, ReuseScratch& scratch, DTreeRecordQueue* recordQueue){
             Spectrum throughput(1.0f);
 
-            std::vector<Vertex> vertices;
-            std::vector<float> prevVertSCs(curr_path.path.size());
-            std::vector<float> prevVertWOs(curr_path.path.size());
+            std::vector<Vertex>& vertices = scratch.vertices;
+            vertices.clear();
+            std::vector<float>& prevVertSCs = scratch.prevVertSCs;
+            prevVertSCs.resize(curr_path.size());
+            std::vector<float>& prevVertWOs = scratch.prevVertWOs;
+            prevVertWOs.resize(curr_path.size());
 
             bool rejected = false;
-            for(std::uint32_t j = 0; j < curr_path.path.size(); ++j){
-                RVertex& curr_vert = curr_path.path[j];
+            std::vector<Point2>& canonicals = scratch.canonicals;
+            computeCanonicals(curr_path, scratch.directions, canonicals);
+
+            for(std::uint32_t j = 0; j < curr_path.size(); ++j){
+                RVertexRef curr_vert = curr_path.vertex(j);
                 Vector dTreeVoxelSize;
                 DTreeWrapper* dTree;
                 float dTreePdf;
 
-                Float newWoPdf = computePdf(curr_vert, dTree, dTreeVoxelSize, dTreePdf);
+                Float newWoPdf = computePdf(curr_vert, canonicals[j], dTree, dTreeVoxelSize, dTreePdf);
 
                 if(noNewPaths){
                     prevVertSCs[j] = curr_vert.sc;
@@ -2552,7 +5249,7 @@ public:
 
                 if(newWoPdf < curr_vert.woPdf){
                     Float acceptProb = newWoPdf / curr_vert.woPdf;
-                    if(sampler->next1D() > acceptProb){
+                    if(scratch.sampler->next1D() > acceptProb){
                         rejected = true;
                         break;
                     }
@@ -2591,39 +5288,35 @@ public:
             }
 
             if(!rejected){
-                computeRadiance(curr_path, vertices, sampler);
+                computeRadiance(curr_path, vertices, scratch.sampler);
 
                 if(m_doNee){
-                    computeNee(curr_path, vertices, sampler);
+                    computeNee(curr_path, vertices, scratch.sampler, recordQueue);
                 }
 
                 for (std::uint32_t j = 0; j < vertices.size(); ++j) {
-                    Float statweight = curr_path.path[j].sc;
+                    Float statweight = curr_path.scaleFactor(j);
                     Float rsw = 1.f;
                     if(m_doNee && m_nee == EKickstart){
                         statweight *= 0.5f;
                         rsw = 0.5f;
                     }
 
-                    std::lock_guard<std::mutex> lg(*m_samplePathMutex);
                     vertices[j].commit(*m_sdTree, statweight, rsw,
-                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler);
+                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, scratch.sampler, recordQueue);
 
                     if(noNewPaths){
-                        curr_path.path[j].sc = prevVertSCs[j];
-                        curr_path.path[j].woPdf = prevVertWOs[j];
+                        curr_path.scaleFactor(j) = prevVertSCs[j];
+                        curr_path.woPdf(j) = prevVertWOs[j];
                     } 
                 }
             }
             else{
                 if(noNewPaths){
-                    curr_path.active = false;
-                    curr_path.path.clear();
-                    curr_path.nee_records.clear();
-                    curr_path.radiance_records.clear();
+                    curr_path.drop();
                 }
             }
-        }
+        });
 
         checkActivePerc();
     }
@@ -2632,27 +5325,25 @@ public:
 
     void reweightCurrentPaths(ref<Sampler> sampler){
         maxrw = std::numeric_limits<float>::min();
-        #pragma omp parallel for
-        for(std::uint32_t i = 0; i < m_samplePaths->size(); ++i){
-            RPath& curr_sample = (*m_samplePaths)[i];
-            if(!curr_sample.active){
-                continue;
-            }
-
-            std::vector<Vertex> vertices;
+        forEachStoredPath(m_samplePaths->size(), sampler, [&](RPathArena::PathRef curr_sample, ReuseScratch& scratch, DTreeRecordQueue* recordQueue){
+            std::vector<Vertex>& vertices = scratch.vertices;
+            vertices.clear();
 
             Spectrum throughput(1.0f);
 
             bool terminated = false;
 
-            for(std::uint32_t j = 0; j < curr_sample.path.size(); ++j){
+            std::vector<Point2>& canonicals = scratch.canonicals;
+            computeCanonicals(curr_sample, scratch.directions, canonicals);
+
+            for(std::uint32_t j = 0; j < curr_sample.size(); ++j){
                 Vector dTreeVoxelSize;
                 DTreeWrapper* dTree;
                 float dTreePdf;
 
-                RVertex& curr_vert = curr_sample.path[j];
+                RVertexRef curr_vert = curr_sample.vertex(j);
 
-                Float newWoPdf = computePdf(curr_vert, dTree, dTreeVoxelSize, dTreePdf);
+                Float newWoPdf = computePdf(curr_vert, canonicals[j], dTree, dTreeVoxelSize, dTreePdf);
 
                 if(newWoPdf < EPSILON){
                     terminated = true;
@@ -2691,31 +5382,28 @@ public:
             }
 
             if(terminated){
-                curr_sample.active = false;
-                curr_sample.path.clear();
-                curr_sample.nee_records.clear();
-                curr_sample.radiance_records.clear();
+                curr_sample.drop();
             }
             else{
-                computeRadiance(curr_sample, vertices, sampler);
+                computeRadiance(curr_sample, vertices, scratch.sampler);
 
                 //compute NEE if enabled
                 if(m_doNee){
-                    computeNee(curr_sample, vertices, sampler);
+                    computeNee(curr_sample, vertices, scratch.sampler, recordQueue);
                 }
 
                 for (std::uint32_t j = 0; j < vertices.size(); ++j) {
-                    Float statweight = curr_sample.path[j].sc;
+                    Float statweight = curr_sample.scaleFactor(j);
                     Float rsw = 1.f;
                     if(m_doNee && m_nee == EKickstart){
                         statweight *= 0.5f;
                         rsw = 0.5f;
                     }
                     vertices[j].commit(*m_sdTree, statweight, rsw,
-                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, sampler); 
+                        m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, scratch.sampler, recordQueue); 
                 }
             }
-        }
+        });
 
         checkActivePerc();
     }
@@ -2789,10 +5477,21 @@ public:
                 m_augment || m_rejectAugment || m_reweightAugment) && !m_sampleless_aug;
 
             if(reuseSamples){
-                size_t num_samples = passesThisIteration * m_sppPerPass * film->getSize().x * film->getSize().y;
+                // The blocks cover the same area as those of BlockedRenderProcess.
+                Point2i offset(0);
+                Vector2i size = film->getCropSize();
+                if (film->hasHighQualityEdges()) {
+                    const int border = film->getReconstructionFilter()->getBorderSize();
+                    offset -= Vector2i(border);
+                    size += Vector2i(2 * border);
+                }
 
-                curr_buffer_pos = m_samplePaths->size();
-                m_samplePaths->resize(num_samples + curr_buffer_pos);
+                m_pathSlots = std::unique_ptr<PathSlotLayout>(new PathSlotLayout(
+                    offset, size, scene->getBlockSize(), m_sppPerPass, passesThisIteration, m_samplePaths->size()));
+                m_samplePaths->resize(m_samplePaths->size() + m_pathSlots->numSlots());
+            }
+            else{
+                m_pathSlots.reset();
             }
 
             Float variance;
@@ -2801,6 +5500,10 @@ public:
                 break;
             }
 
+            if(reuseSamples && m_samplePathMaxMemory >= 0){
+                Log(EInfo, "Spill files of the sample paths: %s", memString(m_samplePaths->spilledBytes()).c_str());
+            }
+
             if((m_augment || m_rejectAugment || m_reweightAugment) && !m_sampleless_aug){
                 if(m_augment){
                     performAugmentedSamples(sampler, m_isFinalIter);
@@ -2856,7 +5559,7 @@ public:
         }
 
         m_samplePaths->clear();
-        m_samplePaths->shrink_to_fit();
+        m_pathSlots.reset();
 
         std::cout << "DONE RENDERING!!!!!!!" << std::endl;
 
@@ -2967,13 +5670,22 @@ public:
         int sceneResID, int sensorResID, int samplerResID) {
 
         m_sdTree = std::unique_ptr<STree>(new STree(scene->getAABB()));
+        m_sdTree->setThreadLocalSplatting(m_threadLocalSplatting);
+        m_sdTree->setSplitDivergenceThreshold(m_sTreeDivergenceThreshold);
 
         if(m_staticSTree){
-            m_sdTree->subdivide(16);
+            // Most cells of a deep static subdivision are never reached by any path; only those
+            // that are get a D-tree.
+            m_sdTree->setLazyDTrees();
+            m_sdTree->subdivide(m_staticSTreeDepth);
         }
 
-        m_samplePathMutex = std::unique_ptr<std::mutex>(new std::mutex());
-        m_samplePaths = std::unique_ptr<std::vector<RPath>>(new std::vector<RPath>());
+        // Subdivision hands the setting down to new D-trees from here on.
+        bool aliasSampling = m_aliasSampling;
+        m_sdTree->forEachDTreeWrapperParallel([aliasSampling](DTreeWrapper* dTree) { dTree->setAliasSampling(aliasSampling); });
+
+        m_samplePaths = std::unique_ptr<RPathArena>(new RPathArena(m_compactPathStorage, m_sdTree->aabb(),
+            m_samplePathMaxMemory < 0 ? std::numeric_limits<size_t>::max() : size_t(m_samplePathMaxMemory) * 1000000));
 
         m_iter = 0;
         m_isFinalIter = false;
@@ -3006,6 +5718,7 @@ public:
         m_startTime = std::chrono::steady_clock::now();
 
         m_passesRendered = 0;
+        m_passesRenderedThisIter = 0;
         switch (m_budgetType) {
             case ESpp:
                 result = renderSPP(scene, queue, job, sceneResID, sensorResID, samplerResID, integratorResID);
@@ -3045,6 +5758,13 @@ public:
     void renderBlock(const Scene *scene, const Sensor *sensor,
         Sampler *sampler, ImageBlock *block, const bool &stop,
         const std::vector< TPoint2<uint8_t> > &points) const {
+        renderBlock(scene, sensor, sampler, block, stop, points, -1);
+    }
+
+    // Same as above, for a block of the pass with the given index in the current iteration (-1 if unknown).
+    void renderBlock(const Scene *scene, const Sensor *sensor,
+        Sampler *sampler, ImageBlock *block, const bool &stop,
+        const std::vector< TPoint2<uint8_t> > &points, int pass) const {
 
         Float diffScaleFactor = 1.0f /
             std::sqrt((Float)m_sppPerPass);
@@ -3059,6 +5779,9 @@ public:
 
         block->clear();
 
+        // Picks the local copies of the sampling distributions, if there are any.
+        NumaTopology::updateCurrentNode();
+
         ref<ImageBlock> squaredBlock = new ImageBlock(block->getPixelFormat(), block->getSize(), block->getReconstructionFilter());
         squaredBlock->setOffset(block->getOffset());
         squaredBlock->clear();
@@ -3078,14 +5801,18 @@ public:
             paths = std::unique_ptr<std::vector<RPath>>(new std::vector<RPath>(num_new_samples));
         }*/
 
-        RPath* main_buffer = nullptr;
+        size_t bufferPos = 0;
+        std::unique_ptr<RPathArena::Segment> segment;
+        RPath rpath;
 
-        if(reuseSamples && !m_sampleless_aug){
-            std::lock_guard<std::mutex> lg(*m_samplePathMutex);
-            size_t buffer_pos = curr_buffer_pos;
-            curr_buffer_pos += points.size() * m_sppPerPass;
+        // Records are committed in batches grouped by D-tree rather than after every path.
+        DTreeRecordQueue recordQueue;
+        DTreeRecordQueue* blockRecordQueue = m_recordBatchSize > 0 ? &recordQueue : nullptr;
 
-            main_buffer = &(*m_samplePaths)[buffer_pos];
+        // Blocks of passes the iteration has no slots for, i.e. of extra final passes,
+        // do not store their paths.
+        if(reuseSamples && !m_sampleless_aug && m_pathSlots && m_pathSlots->reserve(block->getOffset(), pass, bufferPos)){
+            segment = m_samplePaths->newSegment();
         }
 
         for (size_t i = 0; i < points.size(); ++i) {    
@@ -3114,25 +5841,35 @@ public:
 
                     spec *= Li(sensorRay, rRec, (*paths)[path_pos]);*/
 
-                    std::uint32_t path_pos = i * m_sppPerPass + j;
-                    RPath rpath;
-                    spec *= Li(sensorRay, rRec, rpath);
+                    rpath.clear();
+                    spec *= Li(sensorRay, rRec, rpath, blockRecordQueue);
 
-                    if(!m_sampleless_aug){
-                        main_buffer[path_pos] = rpath;
+                    if(segment){
+                        segment->append(rpath);
                     }
                 }
                 else{
-                    spec *= Li(sensorRay, rRec);
+                    rpath.clear();
+                    spec *= Li(sensorRay, rRec, rpath, blockRecordQueue);
                 }
 
                 block->put(samplePos, spec, rRec.alpha);
                 squaredBlock->put(samplePos, spec * spec, rRec.alpha);
                 
                 sampler->advance();
+
+                if (recordQueue.size() >= (size_t)m_recordBatchSize) {
+                    recordQueue.commit(*m_sdTree, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone);
+                }
             }
         }
 
+        recordQueue.commit(*m_sdTree, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone);
+
+        if(segment){
+            m_samplePaths->publish(bufferPos, std::move(segment));
+        }
+
         /*if(reuseSamples){
             std::lock_guard<std::mutex> lg(*m_samplePathMutex);
 
@@ -3150,7 +5887,10 @@ public:
         }
     }
 
-    void pdfMat(Float& woPdf, Float& bsdfPdf, Float& dTreePdf, Float bsdfSamplingFraction, const BSDF* bsdf, const BSDFSamplingRecord& bRec, const DTreeWrapper* dTree, int& curr_level) const {
+    // If knownDTreePdf is given, it is used as the D-tree pdf of bRec.wo (with curr_level left as is)
+    // instead of looking it up in the D-tree, e.g. because the direction was just sampled from it.
+    void pdfMat(Float& woPdf, Float& bsdfPdf, Float& dTreePdf, Float bsdfSamplingFraction, const BSDF* bsdf, const BSDFSamplingRecord& bRec, const DTreeWrapper* dTree, int& curr_level,
+        const Float* knownDTreePdf = nullptr) const {
         dTreePdf = 0;
 
         auto type = bsdf->getType();
@@ -3165,8 +5905,12 @@ public:
             return;
         }
 
-        curr_level = 0;
-        dTreePdf = dTree->pdf(bRec.its.toWorld(bRec.wo), -1, curr_level, m_augment || m_reweightAugment || m_rejectAugment);
+        if (knownDTreePdf) {
+            dTreePdf = *knownDTreePdf;
+        } else {
+            curr_level = 0;
+            dTreePdf = dTree->pdf(bRec.its.toWorld(bRec.wo), -1, curr_level, m_augment || m_reweightAugment || m_rejectAugment);
+        }
 
         woPdf = bsdfSamplingFraction * bsdfPdf + (1 - bsdfSamplingFraction) * dTreePdf;
     }
@@ -3183,6 +5927,8 @@ public:
         }
 
         Spectrum result;
+        Float guidedDTreePdf;
+        const Float* knownDTreePdf = nullptr;
         if (sample.x < bsdfSamplingFraction) {
             sample.x /= bsdfSamplingFraction;
             result = bsdf->sample(bRec, bsdfPdf, sample);
@@ -3202,11 +5948,17 @@ public:
             result *= bsdfPdf;
         } else {
             sample.x = (sample.x - bsdfSamplingFraction) / (1 - bsdfSamplingFraction);
-            bRec.wo = bRec.its.toLocal(dTree->sample(rRec.sampler, (m_augment || m_rejectAugment || m_reweightAugment) && !m_isFinalIter));
+            const bool augment = m_augment || m_rejectAugment || m_reweightAugment;
+            bRec.wo = bRec.its.toLocal(dTree->sample(rRec.sampler, augment && !m_isFinalIter, guidedDTreePdf, dtreeLevel));
             result = bsdf->eval(bRec);
+
+            // pdfMat() keeps using the augmented distribution in the final iteration, sampling doesn't.
+            if (!(augment && m_isFinalIter)) {
+                knownDTreePdf = &guidedDTreePdf;
+            }
         }
 
-        pdfMat(woPdf, bsdfPdf, dTreePdf, bsdfSamplingFraction, bsdf, bRec, dTree, dtreeLevel);
+        pdfMat(woPdf, bsdfPdf, dTreePdf, bsdfSamplingFraction, bsdf, bRec, dTree, dtreeLevel, knownDTreePdf);
 
         //have to increment sample count regardless of if dtree or bsdf was sampled as they both form part of the larger total probability
         if((m_augment || m_rejectAugment || m_reweightAugment) && !result.isZero()){
@@ -3232,6 +5984,8 @@ public:
         }
 
         Spectrum result;
+        Float guidedDTreePdf;
+        const Float* knownDTreePdf = nullptr;
         if (sample.x < bsdfSamplingFraction) {
             sample.x /= bsdfSamplingFraction;
             result = bsdf->sample(bRec, bsdfPdf, sample);
@@ -3251,11 +6005,17 @@ public:
             result *= bsdfPdf;
         } else {
             sample.x = (sample.x - bsdfSamplingFraction) / (1 - bsdfSamplingFraction);
-            bRec.wo = bRec.its.toLocal(dTree->sample(sampler, (m_augment || m_rejectAugment || m_reweightAugment) && !m_isFinalIter));
+            const bool augment = m_augment || m_rejectAugment || m_reweightAugment;
+            bRec.wo = bRec.its.toLocal(dTree->sample(sampler, augment && !m_isFinalIter, guidedDTreePdf, dtreeLevel));
             result = bsdf->eval(bRec);
+
+            // pdfMat() keeps using the augmented distribution in the final iteration, sampling doesn't.
+            if (!(augment && m_isFinalIter)) {
+                knownDTreePdf = &guidedDTreePdf;
+            }
         }
 
-        pdfMat(woPdf, bsdfPdf, dTreePdf, bsdfSamplingFraction, bsdf, bRec, dTree, dtreeLevel);
+        pdfMat(woPdf, bsdfPdf, dTreePdf, bsdfSamplingFraction, bsdf, bRec, dTree, dtreeLevel, knownDTreePdf);
 
         //have to increment sample count regardless of if dtree or bsdf was sampled as they both form part of the larger total probability
         if(m_augment || m_rejectAugment || m_reweightAugment){
@@ -3275,7 +6035,8 @@ public:
         return Li(r, rRec, pathRecord);
     }
 
-    Spectrum Li(const RayDifferential &r, RadianceQueryRecord &rRec, RPath& pathRecord) const {
+    // Records of the path's vertices go to recordQueue if one is given, and directly into the SD-tree otherwise.
+    Spectrum Li(const RayDifferential &r, RadianceQueryRecord &rRec, RPath& pathRecord, DTreeRecordQueue* recordQueue = nullptr) const {
         static const int MAX_NUM_VERTICES = 32;
         std::array<Vertex, MAX_NUM_VERTICES> vertices;
 
@@ -3552,7 +6313,7 @@ public:
                                         false
                                     };
                                     
-                                    v.commit(*m_sdTree, 0.5f, 0.5f, m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, rRec.sampler);
+                                    v.commit(*m_sdTree, 0.5f, 0.5f, m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, rRec.sampler, recordQueue);
                                 }
                             }
 
@@ -3707,7 +6468,7 @@ public:
         if (nVertices > 0 && !m_isFinalIter) {
             for (int i = 0; i < nVertices; ++i) {
                 Float sw = m_nee == EKickstart && m_doNee ? 0.5f : 1.0f;
-                vertices[i].commit(*m_sdTree, sw, sw, m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, rRec.sampler);
+                vertices[i].commit(*m_sdTree, sw, sw, m_spatialFilter, m_directionalFilter, m_isBuilt ? m_bsdfSamplingFractionLoss : EBsdfSamplingFractionLoss::ENone, rRec.sampler, recordQueue);
             }
         }
         
@@ -3897,7 +6658,15 @@ private:
     ESampleCombination m_sampleCombination;
     
 
-    /// Maximum memory footprint of the SDTree in MB. Stops subdividing once reached. -1 to disable.
+    /**
+        Memory budget of the SDTree in MB. Spatial splits are made in order of
+        decreasing energy (flux times sample count) for as long as they fit, the
+        sibling leaves with the least energy are merged again whenever the tree
+        exceeds the budget, and the directional quadtrees drop subdivisions that
+        no longer carry enough energy, with a threshold that is raised until the
+        whole tree fits. -1 to disable.
+        Default = -1
+    */
     int m_sdTreeMaxMemory;
 
     /**
@@ -3935,6 +6704,17 @@ private:
     */
     int m_sTreeThreshold;
 
+    /**
+        If positive, leaf nodes of the spatial binary tree are only subdivided once,
+        in addition to sTreeThreshold, the light recorded in the two halves they would
+        be split into differs by more than this value (a fraction in [0, 1], measured
+        on the directional distribution and the energy of the halves). Keeps the tree
+        coarse where the incident light is smooth, but lets a leaf grow by at most one
+        level per iteration.
+        Default = 0 (disabled)
+    */
+    Float m_sTreeDivergenceThreshold;
+
     /**
         Leaf nodes of the directional quadtree are subdivided if the fraction
         of energy they carry exceeds this value.
@@ -3972,11 +6752,83 @@ private:
     */
     bool m_dumpSDTree;
 
+    /**
+        Whether each worker thread accumulates its D-tree records in a private sparse
+        buffer that is merged into the SD-tree after every batch of render passes and
+        before building. Avoids contention on the shared atomics when many threads
+        record into the same bright regions. Gradients for the learned BSDF sampling
+        fraction are collected per thread as well and handed to the optimizer in
+        whole batches, without ever waiting for its lock.
+        When false, every record is added atomically to the building trees and
+        every gradient is appended under the lock right away.
+        Default = false
+    */
+    bool m_threadLocalSplatting;
+
+    /**
+        Whether every NUMA node gets its own copy of the (read-only) sampling
+        distributions after they are built, such that render threads sample
+        from memory that is local to the socket they run on. Costs one extra
+        copy of the compact sampling trees per node; has no effect on machines
+        with a single node.
+        Default = false
+    */
+    bool m_numaReplication;
+
+    /**
+        Number of records a render block collects before committing them to the
+        SD-tree, grouped by D-tree. Box-filtered records spanning several spatial
+        leaves are always committed right away. 0 commits every record as soon as
+        its path is finished. Since the BSDF sampling fraction is only optimized
+        on commit, later paths of the same block (or thread, in the reuse passes)
+        see a fraction that lags behind by up to this many records.
+        Default = 0
+    */
+    int m_recordBatchSize;
+
+    /**
+        Whether the guiding distributions are sampled through per-iteration alias
+        tables over their leaves, which takes constant time regardless of the
+        depth of the quadtrees, instead of descending them level by level.
+        Costs roughly 20 bytes of extra memory per leaf of every built D-tree.
+        Default = false
+    */
+    bool m_aliasSampling;
+
+    /**
+        Number of levels of the spatial binary tree when staticSTree is enabled,
+        i.e. the scene is split into 2^staticSTreeDepth cells. Cells only get a
+        directional distribution once a path reaches them, so unreached cells
+        cost a few bytes each.
+        Default = 16
+    */
+    int m_staticSTreeDepth;
+
+    /**
+        Whether the sample paths kept for reuse are stored with quantized
+        positions, directions and BSDF values (see RPathArena), which takes
+        about 30% less memory per vertex at a tiny loss of precision.
+        Default = false
+    */
+    bool m_compactPathStorage;
+
+    /**
+        Memory budget in MB for the vertices and records of the sample paths
+        kept for reuse. Paths beyond it are spilled to temporary memory-mapped
+        files, which the reuse passes read back ahead of time. The temporary
+        directory should thus not be memory-backed. -1 to disable.
+        Default = -1
+    */
+    int m_samplePathMaxMemory;
+
     /// The time at which rendering started.
     std::chrono::steady_clock::time_point m_startTime;
 
-    std::unique_ptr<std::vector<RPath>> m_samplePaths;
-    std::unique_ptr<std::mutex> m_samplePathMutex;
+    std::unique_ptr<RPathArena> m_samplePaths;
+    // Where the blocks of the current iteration store their paths, if it stores any.
+    std::unique_ptr<PathSlotLayout> m_pathSlots;
+    // Scratch list of the stored paths that a reuse pass processes.
+    std::vector<std::uint32_t> m_activePaths;
 
     bool m_reweight;
     bool m_reject;
@@ -3997,6 +6849,23 @@ public:
     MTS_DECLARE_CLASS()
 };
 
+void GuidedBlockRenderer::process(const WorkUnit *workUnit, WorkResult *workResult,
+    const bool &stop) {
+    const RectangularWorkUnit *rect = static_cast<const RectangularWorkUnit *>(workUnit);
+    ImageBlock *block = static_cast<ImageBlock *>(workResult);
+
+    block->setOffset(rect->getOffset());
+    block->setSize(rect->getSize());
+    m_hilbertCurve.initialize(TVector2<uint8_t>(rect->getSize()));
+    static_cast<GuidedPathTracer *>(m_integrator.get())->renderBlock(m_scene, m_sensor, m_sampler,
+        block, stop, m_hilbertCurve.getPoints(), m_pass);
+}
+
+MTS_IMPLEMENT_CLASS_S(GuidedBlockRenderer, false, WorkProcessor)
+MTS_IMPLEMENT_CLASS(GuidedRenderProcess, false, BlockedRenderProcess)
 MTS_IMPLEMENT_CLASS(GuidedPathTracer, false, MonteCarloIntegrator)
+#if !defined(MTS_TESTCASE)
+/* The path storage tests include this file and export a test case instead. */
 MTS_EXPORT_PLUGIN(GuidedPathTracer, "Guided path tracer");
+#endif
 MTS_NAMESPACE_END
@@ -0,0 +1,250 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/testcase.h>
+#include <mitsuba/core/random.h>
+
+/* The tested classes are internal to the guided path tracer */
+#include "../integrators/path/guided_path.cpp"
+
+MTS_NAMESPACE_BEGIN
+
+class TestGuidedPath : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_packPosition)
+	MTS_DECLARE_TEST(test02_packDirection)
+	MTS_DECLARE_TEST(test03_packSpectrum)
+	MTS_DECLARE_TEST(test04_pathSlotLayout)
+	MTS_END_TESTCASE()
+
+	/* Angle between two directions, which is accurate for small angles unlike acos() */
+	Float angle(const Vector &a, const Vector &b) {
+		return 2 * std::asin(std::min((normalize(a) - normalize(b)).length() / 2, (Float) 1));
+	}
+
+	/* Packs p into a compact segment and returns the decoded position */
+	Point roundTrip(RPathArena::Segment &segment, const Point &p, bool isDelta) {
+		segment.packedPositions.push_back(segment.packPosition(p, isDelta));
+		const uint32_t k = (uint32_t) segment.packedPositions.size() - 1;
+		assertTrue(segment.isDelta(k) == isDelta);
+		return segment.position(k);
+	}
+
+	Vector roundTrip(const Vector &d) {
+		return RPathArena::unpackDirection(RPathArena::packDirection(d));
+	}
+
+	Spectrum roundTrip(const Spectrum &s) {
+		return RPathArena::unpackSpectrum(RPathArena::packSpectrum(s));
+	}
+
+	void test01_packPosition() {
+		const AABB aabb(Point(-2, 0.5f, 10), Point(3, 0.75f, 1000));
+		RPathArena::Segment segment(true, aabb);
+		ref<Random> random = new Random(1234);
+
+		/* The documented bound, plus the rounding of the float arithmetic */
+		Vector bound;
+		for (int a = 0; a < 3; ++a)
+			bound[a] = std::ldexp(aabb.max[a] - aabb.min[a], -22)
+				+ 4 * std::numeric_limits<Float>::epsilon()
+				* std::max(std::abs(aabb.min[a]), std::abs(aabb.max[a]));
+
+		std::vector<Point> points;
+		for (int i = 0; i < 100000; ++i) {
+			Point p;
+			for (int a = 0; a < 3; ++a)
+				p[a] = aabb.min[a] + random->nextFloat() * (aabb.max[a] - aabb.min[a]);
+			points.push_back(p);
+		}
+
+		/* Corners, points on the faces and points outside of the bounds */
+		for (int i = 0; i < 8; ++i)
+			points.push_back(aabb.getCorner(i));
+		points.push_back(Point(aabb.min.x, 0.6f, 500));
+		points.push_back(Point(1, aabb.max.y, 20));
+		points.push_back(Point(-100, 0.7f, 2000));
+		points.push_back(Point(5, -1, 5));
+		points.push_back(Point(std::numeric_limits<Float>::max(), 0.6f,
+			-std::numeric_limits<Float>::max()));
+
+		Vector maxError(0.0f);
+		for (size_t i = 0; i < points.size(); ++i) {
+			const Point &p = points[i];
+			const Point q = roundTrip(segment, p, i % 2 == 0);
+			for (int a = 0; a < 3; ++a) {
+				/* Positions outside of the bounds are clamped */
+				const Float expected = math::clamp(p[a], aabb.min[a], aabb.max[a]);
+				maxError[a] = std::max(maxError[a], std::abs(q[a] - expected));
+			}
+		}
+
+		for (int a = 0; a < 3; ++a)
+			assertTrue(maxError[a] <= bound[a]);
+	}
+
+	void test02_packDirection() {
+		ref<Random> random = new Random(1234);
+
+		std::vector<Vector> directions;
+		for (int i = 0; i < 100000; ++i)
+			directions.push_back(warp::squareToUniformSphere(
+				Point2(random->nextFloat(), random->nextFloat())));
+
+		/* Axes and the edges of the octahedron, with either sign of zero */
+		const Float zeros[] = { 0.0f, -0.0f };
+		for (int i = 0; i < 2; ++i) {
+			for (int j = 0; j < 2; ++j) {
+				const Float z0 = zeros[i], z1 = zeros[j];
+				directions.push_back(Vector(z0, z1, 1));
+				directions.push_back(Vector(z0, z1, -1));
+				directions.push_back(Vector(1, z0, z1));
+				directions.push_back(Vector(-1, z0, z1));
+				directions.push_back(Vector(z0, 1, z1));
+				directions.push_back(Vector(z0, -1, z1));
+				directions.push_back(Vector(1, 1, z0));
+				directions.push_back(Vector(-1, 1, z1));
+				directions.push_back(Vector(1, -1, z0));
+				directions.push_back(Vector(-1, -1, z1));
+			}
+		}
+
+		/* The lower hemisphere near the fold of the octahedron, and unnormalized directions */
+		directions.push_back(Vector(0.5f, 0.5f, -1e-6f));
+		directions.push_back(Vector(-0.3f, 0.7f, -1e-6f));
+		directions.push_back(Vector(0.2f, -0.1f, -0.9f));
+		directions.push_back(Vector(-1e-20f, -2e-20f, -3e-20f));
+		directions.push_back(Vector(1e15f, -2e15f, -3e15f));
+
+		Float maxError = 0;
+		for (size_t i = 0; i < directions.size(); ++i)
+			maxError = std::max(maxError, angle(directions[i], roundTrip(directions[i])));
+		assertTrue(maxError < 1e-4f);
+
+		/* Zero and non-finite directions decode to +z */
+		const Float inf = std::numeric_limits<Float>::infinity();
+		const Float nan = std::numeric_limits<Float>::quiet_NaN();
+		const Vector degenerate[] = {
+			Vector(0.0f), Vector(-0.0f), Vector(nan, 0, 1), Vector(0, nan, -1),
+			Vector(0, 0, nan), Vector(inf, 0, 0), Vector(0, -inf, 0), Vector(1, 0, -inf)
+		};
+		for (size_t i = 0; i < sizeof(degenerate) / sizeof(degenerate[0]); ++i) {
+			const Vector d = roundTrip(degenerate[i]);
+			assertTrue(std::isfinite(d.x) && std::isfinite(d.y) && std::isfinite(d.z));
+			assertTrue(angle(d, Vector(0, 0, 1)) < 1e-4f);
+		}
+	}
+
+	/* Checks the documented bound of 2^-16 of the largest channel */
+	void assertSpectrumRoundTrip(const Spectrum &s) {
+		const Spectrum t = roundTrip(s);
+		const Float bound = std::ldexp(s.max(), -16);
+		for (int i = 0; i < SPECTRUM_SAMPLES; ++i) {
+			assertTrue(std::isfinite(t[i]) && t[i] >= 0);
+			assertTrue(std::abs(t[i] - s[i]) <= bound);
+		}
+	}
+
+	void test03_packSpectrum() {
+		ref<Random> random = new Random(1234);
+
+		for (int i = 0; i < 100000; ++i) {
+			Spectrum s;
+			const Float scale = std::pow((Float) 10, 20 * random->nextFloat() - 10);
+			for (int j = 0; j < SPECTRUM_SAMPLES; ++j)
+				s[j] = random->nextFloat() * scale;
+			assertSpectrumRoundTrip(s);
+		}
+
+		/* Zero, tiny and huge channels */
+		const Float huge = std::numeric_limits<Float>::max();
+		for (int i = 0; i < SPECTRUM_SAMPLES; ++i) {
+			Spectrum s(0.0f);
+			s[i] = huge;
+			assertSpectrumRoundTrip(s);
+			s[(i + 1) % SPECTRUM_SAMPLES] = 1;
+			assertSpectrumRoundTrip(s);
+			s[i] = 1e-30f;
+			assertSpectrumRoundTrip(s);
+		}
+		assertSpectrumRoundTrip(Spectrum(huge));
+		assertSpectrumRoundTrip(Spectrum(65535.75f));
+
+		/* Black spectra stay exactly black, and zero channels exactly zero */
+		assertEquals(roundTrip(Spectrum(0.0f)), Spectrum(0.0f));
+		Spectrum s(0.0f);
+		s[0] = 3;
+		assertEquals(roundTrip(s), s);
+
+		/* Negative channels are stored as zero, and non-finite spectra as black */
+		s[SPECTRUM_SAMPLES - 1] = -1;
+		Spectrum clamped(0.0f);
+		clamped[0] = 3;
+		assertEquals(roundTrip(s), clamped);
+		assertEquals(roundTrip(Spectrum(-1.0f)), Spectrum(0.0f));
+
+		const Float inf = std::numeric_limits<Float>::infinity();
+		const Float nan = std::numeric_limits<Float>::quiet_NaN();
+		for (int i = 0; i < SPECTRUM_SAMPLES; ++i) {
+			Spectrum t(1.0f);
+			t[i] = inf;
+			assertEquals(roundTrip(t), Spectrum(0.0f));
+			t[i] = nan;
+			assertEquals(roundTrip(t), Spectrum(0.0f));
+		}
+	}
+
+	void test04_pathSlotLayout() {
+		/* The blocks of BlockedImageProcess, with partial blocks at the right and bottom */
+		const Point2i offset(3, 5);
+		const Vector2i size(37, 21);
+		const int blockSize = 8, sppPerPass = 2, numPasses = 3;
+		const size_t firstSlot = 100;
+		const PathSlotLayout layout(offset, size, blockSize, sppPerPass, numPasses, firstSlot);
+		assertTrue(layout.numSlots() == size_t(size.x) * size.y * sppPerPass * numPasses);
+
+		/* Every slot must belong to exactly one block of one pass */
+		std::vector<int> owners(layout.numSlots(), 0);
+		for (int pass = 0; pass < numPasses; ++pass) {
+			for (int y = 0; y < size.y; y += blockSize) {
+				for (int x = 0; x < size.x; x += blockSize) {
+					const Vector2i extent(std::min(blockSize, size.x - x), std::min(blockSize, size.y - y));
+					size_t slot = 0;
+					assertTrue(layout.reserve(offset + Vector2i(x, y), pass, slot));
+					assertTrue(slot >= firstSlot);
+
+					const size_t numSlots = size_t(extent.x) * extent.y * sppPerPass;
+					assertTrue(slot - firstSlot + numSlots <= owners.size());
+					for (size_t i = 0; i < numSlots; ++i)
+						++owners[slot - firstSlot + i];
+				}
+			}
+		}
+		for (size_t i = 0; i < owners.size(); ++i)
+			assertEquals(owners[i], 1);
+
+		/* Passes that the layout was not made for */
+		size_t slot = 0;
+		assertFalse(layout.reserve(offset, -1, slot));
+		assertFalse(layout.reserve(offset, numPasses, slot));
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestGuidedPath, "Testcase for the path storage of the guided path tracer")
+MTS_NAMESPACE_END
@@ -24,6 +24,7 @@
 #include <iomanip> // setprecision
 #include <sstream> // stringstream
 #include <memory>
+#include <cstring> // memcpy
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -60,9 +61,15 @@ private:
 
 static const int NUM_CHANNELS = 1;
 
+// Header of the .sdt files written by the guided path tracer: magic number ("SDTF") and format version.
+// Files without it predate version 2 and store the child links of the D-tree nodes with 16 instead of 32 bits.
+static const uint32_t SDT_MAGIC = 0x46544453;
+static const uint32_t SDT_VERSION = 2;
+static const uint32_t SDT_LEGACY_VERSION = 1;
+
 struct QuadTreeNode {
     array<array<float, 4>, NUM_CHANNELS> data;
-    array<uint16_t, 4> children;
+    array<uint32_t, 4> children;
 
     inline bool isLeaf(int index) const {
         return children[index] == 0;
@@ -139,7 +146,7 @@ public:
         return mNumSamples;
     }
 
-    bool read(BlobReader& blob) {
+    bool read(BlobReader& blob, uint32_t version) {
         uint64_t numNodes;
         uint64_t numSamples;
         blob >> mPos.x() >> mPos.y() >> mPos.z() >> mSize.x() >> mSize.y() >> mSize.z() >> mMean >> numSamples >> numNodes;
@@ -165,7 +172,13 @@ public:
                         cerr << "INVALID NODE: " << n.data[k][j] << endl;
                     }
                 }
-                blob >> n.children[j];
+                if (version == SDT_LEGACY_VERSION) {
+                    uint16_t child;
+                    blob >> child;
+                    n.children[j] = child;
+                } else {
+                    blob >> n.children[j];
+                }
             }
         }
 
@@ -437,18 +450,36 @@ public:
     }
 
     void loadSDTree(string filename) {
-        size_t last = filename.find_last_of(separator()) + 1;
-        new Label(mImageContainer, filename.substr(last, filename.size() - last), "sans-bold");
-
         BlobReader reader(filename);
 
+        // Files without a header start right away with the camera matrix.
         Matrix4f camera;
+        uint32_t magic = 0;
+        uint32_t version = SDT_LEGACY_VERSION;
+        reader >> magic;
+        if (magic == SDT_MAGIC) {
+            reader >> version;
+            reader >> camera(0, 0);
+        } else {
+            memcpy(&camera(0, 0), &magic, sizeof(float));
+        }
+
+        if (!reader.isValid() || version > SDT_VERSION) {
+            cerr << "Cannot read " << filename << ": not an SD-tree of a supported format version." << endl;
+            return;
+        }
+
         for (int i = 0; i < 4; ++i) {
             for (int j = 0; j < 4; ++j) {
-                reader >> camera(i, j);
+                if (i > 0 || j > 0) {
+                    reader >> camera(i, j);
+                }
             }
         }
 
+        size_t last = filename.find_last_of(separator()) + 1;
+        new Label(mImageContainer, filename.substr(last, filename.size() - last), "sans-bold");
+
         if (mSDTrees.size() == 0) {
             mCamera = camera.inverse();
             mCamera.row(0) *= -1;
@@ -466,7 +497,7 @@ public:
 
         while (true) {
 			shared_ptr<DTree> dTree = shared_ptr<DTree>(new DTree());
-            if (!dTree->read(reader)) {
+            if (!dTree->read(reader, version)) {
                 break;
             }
 